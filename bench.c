@@ -2,9 +2,17 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <x86intrin.h>
 #include "fp64set.h"
+#include "fp128set.h"
 
 static inline uint64_t rotr64(uint64_t x, int r)
 {
@@ -48,6 +56,34 @@ void addUniq(struct fp64set *set, size_t *np, uint64_t *tp)
     *tp = t1 - t0;
 }
 
+// Same as addUniq, but only time the adds beyond the given fill factor,
+// where the evictions mostly happen.  Returns false if the structure
+// resized before reaching the fill factor (nothing is timed then).
+bool addFull(struct fp64set *set, double ff, size_t *np, uint64_t *tp)
+{
+    size_t n = 0;
+    size_t skip = ff * set->bsize * (set->mask + 1);
+    skip = skip > set->cnt ? skip - set->cnt : 0;
+    uint64_t t0 = skip ? 0 : __rdtsc();
+    uint64_t t1 = t0;
+    while (1) {
+	int rc = fp64set_add(set, rnd());
+	assert(rc > 0);
+	if (rc > 1)
+	    break;
+	n++;
+	t1 = __rdtsc();
+	if (n == skip)
+	    t0 = t1;
+    }
+    if (n > skip) {
+	*np = n - skip, *tp = t1 - t0;
+	return true;
+    }
+    *np = 0, *tp = 0;
+    return false;
+}
+
 // From MurmurHash3.
 static inline uint64_t fmix64(uint64_t x)
 {
@@ -101,6 +137,31 @@ double bench_addUniq(int bsize, int logsize, double *fill)
     return (double) t / n;
 }
 
+// The fill factor beyond which the adds are timed.  With bsize=2, the
+// structure resizes at about 89.7% on average, so 90% is often missed.
+static inline double fullFill(int bsize)
+{
+    return bsize > 2 ? 0.90 : 0.85;
+}
+
+double bench_addFull(int bsize, int logsize, int *skipped)
+{
+    size_t n = 0; uint64_t t = 0;
+    *skipped = 0;
+    for (int i = 0; i < (1<<ITER); i++) {
+	struct fp64set *set = fp64set_new(logsize);
+	size_t n1 = 0; uint64_t t1 = 0;
+	for (int i = 2; i < bsize; i++)
+	    addUniq(set, &n1, &t1);
+	if (addFull(set, fullFill(bsize), &n1, &t1))
+	    n += n1, t += t1;
+	else
+	    ++*skipped;
+	fp64set_free(set);
+    }
+    return n ? (double) t / n : 0;
+}
+
 double bench_addDups(int bsize, int logsize)
 {
     size_t n = 0; uint64_t t = 0;
@@ -119,6 +180,85 @@ double bench_addDups(int bsize, int logsize)
     return (double) t / n;
 }
 
+// An HDR-style histogram of latencies: each power of two is split into
+// 32 linear sub-buckets, so a value is recorded with 3% precision.
+#define HIST_SUB 32
+static uint64_t hist[64 * HIST_SUB];
+
+static inline void histAdd(uint64_t t)
+{
+    if (t < HIST_SUB) {
+	hist[t]++;
+	return;
+    }
+    int e = 63 - __builtin_clzll(t);
+    hist[(e - 4) * HIST_SUB + (t >> (e - 5))]++;
+}
+
+// The lower bound of the i-th bucket.
+static uint64_t histValue(size_t i)
+{
+    if (i < 2 * HIST_SUB)
+	return i;
+    size_t e = i / HIST_SUB + 3;
+    return (uint64_t) (i % HIST_SUB + HIST_SUB) << (e - 5);
+}
+
+static uint64_t histPercentile(uint64_t n, double p)
+{
+    uint64_t k = p * n, sum = 0;
+    for (size_t i = 0; i < 64 * HIST_SUB; i++) {
+	sum += hist[i];
+	if (sum > k)
+	    return histValue(i);
+    }
+    return histValue(64 * HIST_SUB - 1);
+}
+
+#include <sys/resource.h>
+
+static long peakRSS(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024;
+}
+
+// Time every add() through full fill cycles, resizes included, starting
+// at logsize and going on until the set reaches bsize=4 at maxlog.
+// Each transition is reported as it happens.
+void bench_addLat(int logsize, int maxlog)
+{
+    memset(hist, 0, sizeof hist);
+    struct fp64set *set = fp64set_new(logsize);
+    uint64_t n = 0, max = 0;
+    // The peak only grows on resizes, no need for a syscall per add.
+    long rss = peakRSS();
+    while (1) {
+	int bsize0 = set->bsize, logsize0 = set->logsize;
+	uint64_t t0 = __rdtsc();
+	int rc = fp64set_add(set, rnd());
+	uint64_t t = __rdtsc() - t0;
+	assert(rc > 0);
+	histAdd(t), n++;
+	if (t > max)
+	    max = t;
+	if (rc > 1) {
+	    long rss0 = rss;
+	    rss = peakRSS();
+	    printf("resize %d/%d -> %d/%d cnt=%zu %.2fM cycles peak RSS %ld -> %ldM\n",
+		    logsize0, bsize0, set->logsize, set->bsize, set->cnt,
+		    t / 1e6, rss0, rss);
+	    if (set->logsize >= maxlog && set->bsize == 4)
+		break;
+	}
+    }
+    printf("add lat n=%" PRIu64 " p50 %" PRIu64 " p99 %" PRIu64 " p999 %" PRIu64 " max %" PRIu64 "\n",
+	    n, histPercentile(n, 0.5), histPercentile(n, 0.99),
+	    histPercentile(n, 0.999), max);
+    fp64set_free(set);
+}
+
 double bench_has(int bsize, int logsize)
 {
     size_t n = 0; uint64_t t = 0;
@@ -136,6 +276,1009 @@ double bench_has(int bsize, int logsize)
     return (double) (t + dummy % 2) / n;
 }
 
+// Fill a set to 90% at bsize=4, and make n queries at the given hit ratio
+// (percent), the hits being drawn from the fingerprints added.  The set
+// may double more than once before it gets there.
+static struct fp64set *fillQueries(int logsize, int hit, uint64_t *qq, size_t n)
+{
+    struct fp64set *set = fp64set_new(logsize);
+    size_t nk = 0, maxk = 4 << logsize;
+    uint64_t *kk = malloc(maxk * sizeof *kk);
+    assert(set && kk);
+    while (set->bsize < 4 || set->cnt < 0.9 * 4 * (set->mask + 1)) {
+	if (nk == maxk) {
+	    maxk *= 2;
+	    kk = realloc(kk, maxk * sizeof *kk);
+	    assert(kk);
+	}
+	uint64_t fp = rnd();
+	int rc = fp64set_add(set, fp);
+	assert(rc > 0);
+	kk[nk++] = fp;
+    }
+    for (size_t i = 0; i < n; i++)
+	qq[i] = rnd() % 100 < (unsigned) hit ? kk[rnd() % nk] : rnd();
+    free(kk);
+    return set;
+}
+
+// Lookups at the given hit ratio (percent) in a bsize=4 set filled to 90%:
+// without the prefilter, with the prefilter, and with fp64set_has_batch().
+void bench_hasRatio(int logsize, int hit, double t[3])
+{
+    size_t n = 1 << 20;
+    uint64_t *qq = malloc(n * sizeof *qq);
+    assert(qq);
+    struct fp64set *set = fillQueries(logsize, hit, qq, n);
+    bool out[1024];
+    size_t dummy = 0;
+    int iter = 1 << (ITER + logsize - 20 > 0 ? ITER + logsize - 20 : 0);
+    for (int k = 0; k < 3; k++) {
+	if (k == 1)
+	    fp64set_prefilter(set, 8);
+	uint64_t t0 = __rdtsc();
+	for (int j = 0; j < iter; j++) {
+	    if (k < 2)
+		for (size_t i = 0; i < n; i++)
+		    dummy += fp64set_has(set, qq[i]);
+	    else
+		for (size_t i = 0; i < n; i += 1024)
+		    dummy += fp64set_has_batch(set, qq + i, 1024, out);
+	}
+	t[k] = (double) (__rdtsc() - t0 + dummy % 2) / n / iter;
+    }
+    fp64set_free(set);
+    free(qq);
+}
+
+// Lookups with each kernel, at a given hit ratio; t[k] < 0 if the kernel
+// is not available.  Returns the kernel chosen by fp64set_autotune().
+int bench_hasKernel(int logsize, int hit, double t[3])
+{
+    size_t n = 1 << 20;
+    uint64_t *qq = malloc(n * sizeof *qq);
+    assert(qq);
+    struct fp64set *set = fillQueries(logsize, hit, qq, n);
+    size_t dummy = 0;
+    int iter = 1 << (ITER + logsize - 20 > 0 ? ITER + logsize - 20 : 0);
+    for (int k = 0; k < 3; k++) {
+	t[k] = -1;
+	if (fp64set_set_kernel(set, k) < 0)
+	    continue;
+	uint64_t t0 = __rdtsc();
+	for (int j = 0; j < iter; j++)
+	    for (size_t i = 0; i < n; i++)
+		dummy += fp64set_has(set, qq[i]);
+	t[k] = (double) (__rdtsc() - t0 + dummy % 2) / n / iter;
+    }
+    int kernel = fp64set_autotune(set, hit);
+    fp64set_free(set);
+    free(qq);
+    return kernel;
+}
+
+// Lookups in a frozen copy of a bsize=4 set, filled up to the resize point.
+double bench_hasFrozen(int logsize, double *bpf)
+{
+    size_t n = 0; uint64_t t = 0;
+    struct fp64set *set = fp64set_new(logsize);
+    for (int i = 2; i <= 4; i++)
+	addUniq(set, &n, &t);
+    struct fp64set_frozen *fz = fp64set_freeze(set);
+    assert(fz);
+    *bpf = (double) fz->imagesize / fz->cnt;
+    fp64set_free(set);
+    n = 1 << (logsize + ITER);
+    t = __rdtsc();
+    size_t dummy = 0;
+    for (size_t i = 0; i < n; i++)
+	dummy += fp64set_frozen_has(fz, rnd());
+    t = __rdtsc() - t;
+    fp64set_frozen_free(fz);
+    return (double) (t + dummy % 2) / n;
+}
+
+// Counting the fingerprints already in the counter, against refreshing
+// them in a windowed set of the same size, which is the same C code but
+// for the store; then the C lookup which both of them start with, against
+// the SSE4 lookup routine over the same buckets.  The last two bound what
+// an assembly version of fp64set_counter_add() could save.
+void bench_counter(int logsize, double t[4])
+{
+    size_t nk = 4 << logsize, n = 1 << 20;
+    uint64_t *kk = malloc(nk * sizeof *kk);
+    uint64_t *qq = malloc(n * sizeof *qq);
+    assert(kk && qq);
+    struct fp64set_counter *c = fp64set_counter_new(logsize + 2);
+    struct fp64set_window *w = fp64set_window_new(logsize + 2, 1U << 31);
+    assert(c && w);
+    for (size_t i = 0; i < nk; i++) {
+	kk[i] = rnd();
+	uint32_t cnt = fp64set_counter_add(c, kk[i]);
+	int rc = fp64set_window_add(w, kk[i]);
+	assert(cnt == 1 && rc > 0);
+    }
+    for (size_t i = 0; i < n; i++)
+	qq[i] = kk[rnd() % nk];
+    size_t dummy = 0;
+    int iter = 1 << (ITER + logsize - 20 > 0 ? ITER + logsize - 20 : 0);
+    for (int k = 0; k < 4; k++) {
+	uint64_t t0 = __rdtsc();
+	for (int j = 0; j < iter; j++)
+	    for (size_t i = 0; i < n; i++)
+		switch (k) {
+		case 0: dummy += fp64set_counter_add(c, qq[i]); break;
+		case 1: dummy += fp64set_window_add(w, qq[i]); break;
+		case 2: dummy += fp64set_counter_get(c, qq[i]); break;
+		default: dummy += fp64set_counter_has(c, qq[i]);
+		}
+	t[k] = (double) (__rdtsc() - t0 + dummy % 2) / n / iter;
+    }
+    fp64set_counter_free(c);
+    fp64set_window_free(w);
+    free(kk), free(qq);
+}
+
+// Check that the stashed fingerprints are found by each kernel, through
+// both has() and add().  The sets are small, so that the stash is used
+// often, and are filled until they double twice.  Returns false on a miss.
+bool check_stash(int logsize)
+{
+    (void) logsize;
+    size_t n = 0, miss = 0;
+    for (int i = 0; i < (1<<ITER); i++) {
+	struct fp64set *set = fp64set_new(4);
+	int kernel = fp64set_kernel(set);
+	while (set->logsize < 6) {
+	    int rc = fp64set_add(set, rnd());
+	    assert(rc > 0);
+	    for (int k = 0; set->nstash && k <= FP64SET_KERNEL_SSE4; k++) {
+		if (fp64set_set_kernel(set, k) < 0)
+		    continue;
+		for (int j = 0; j < set->nstash; j++, n++) {
+		    uint64_t fp = set->stash[j];
+		    miss += !fp64set_has(set, fp);
+		    miss += fp64set_add(set, fp) != 0;
+		}
+	    }
+	    fp64set_set_kernel(set, kernel);
+	}
+	fp64set_free(set);
+    }
+    printf("stash %zu lookups %zu misses\n", n, miss);
+    return miss == 0;
+}
+
+// Check frozen sets of different sizes, from empty to the resize point,
+// against the live sets they are made of, and then the same frozen sets
+// saved and loaded back: the image must come back byte for byte, and
+// answer the same lookups.  Returns false on a mismatch.
+bool check_frozen(int logsize)
+{
+    char fname[] = "/tmp/bench-frozen.XXXXXX";
+    int fd = mkstemp(fname);
+    assert(fd >= 0);
+    close(fd);
+    size_t maxk = 4 << logsize;
+    uint64_t *kk = malloc(maxk * sizeof *kk);
+    assert(kk);
+    size_t n = 0, bad = 0;
+    for (int r = 0; r < 16; r++) {
+	struct fp64set *set = fp64set_new(logsize);
+	size_t nk = r ? rnd() % maxk : 0;
+	for (size_t i = 0; i < nk; i++) {
+	    kk[i] = rnd();
+	    int rc = fp64set_add(set, kk[i]);
+	    assert(rc > 0);
+	}
+	struct fp64set_frozen *fz = fp64set_freeze(set);
+	assert(fz);
+	int rc = fp64set_frozen_save(fz, fname);
+	assert(rc == 0);
+	struct fp64set_frozen *fz2 = fp64set_frozen_load(fname);
+	assert(fz2);
+	bad += fz->cnt != nk || fz2->cnt != nk;
+	bad += fz2->imagesize != fz->imagesize ||
+		memcmp(fz2->image, fz->image, fz->imagesize);
+	for (size_t i = 0; i < nk; i++, n += 2) {
+	    bad += !fp64set_frozen_has(fz, kk[i]);
+	    bad += !fp64set_frozen_has(fz2, kk[i]);
+	}
+	for (size_t i = 0; i < maxk; i++, n += 2) {
+	    uint64_t fp = rnd();
+	    bool has = fp64set_has(set, fp);
+	    bad += fp64set_frozen_has(fz, fp) != has;
+	    bad += fp64set_frozen_has(fz2, fp) != has;
+	}
+	fp64set_frozen_free(fz);
+	fp64set_frozen_free(fz2);
+	fp64set_free(set);
+    }
+    unlink(fname);
+    free(kk);
+    printf("frozen %zu lookups %zu bad\n", n, bad);
+    return bad == 0;
+}
+
+static int cmpU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// A call made by check_trace(), to be found in the trace.
+struct traceOp {
+    uint64_t fp;
+    int op, rc;
+};
+
+struct traceThread {
+    const struct fp64set *set;
+    const uint64_t *fpv;
+    size_t n;
+};
+
+static void *traceThread(void *arg)
+{
+    struct traceThread *a = arg;
+    for (size_t i = 0; i < a->n; i++)
+	fp64set_has(a->set, a->fpv[i]);
+    return NULL;
+}
+
+// Trace a mix of adds, lookups and batched lookups, then lookups from
+// several threads at once, and read the trace back.  It must hold the
+// contents of the set, the calls in the order they were made, with their
+// return values, and each of the threads' lookups exactly once.  The calls
+// are then replayed against a new set, as replay.c does, and must return
+// the same (a resize may happen elsewhere).  Returns false on a mismatch.
+bool check_trace(int logsize)
+{
+    char fname[] = "/tmp/bench-trace.XXXXXX";
+    int fd = mkstemp(fname);
+    assert(fd >= 0);
+    close(fd);
+    size_t n0 = 2 << logsize, nops = 8 << logsize, nthr = 4, nt = n0 / 2;
+    uint64_t *kk = malloc((n0 + nops) * sizeof *kk);
+    uint64_t *v = malloc((n0 + nthr * nt) * sizeof *v);
+    struct traceOp *ops = malloc(nops * sizeof *ops);
+    assert(kk && v && ops);
+    struct fp64set *set = fp64set_new(logsize);
+    for (size_t i = 0; i < n0; i++) {
+	kk[i] = rnd();
+	int rc = fp64set_add(set, kk[i]);
+	assert(rc > 0);
+    }
+    int logsize0 = set->logsize;
+    int rc = fp64set_trace(set, fname);
+    assert(rc == 0);
+    size_t nk = n0;
+    for (size_t i = 0; i < nops; ) {
+	uint64_t fpv[16];
+	bool out[16];
+	size_t m = nops - i < 16 ? nops - i : 16;
+	for (size_t j = 0; j < m; j++)
+	    fpv[j] = rnd() % 2 ? kk[rnd() % nk] : rnd();
+	switch (rnd() % 3) {
+	case 0:
+	    rc = fp64set_add(set, fpv[0]);
+	    assert(rc >= 0);
+	    if (rc)
+		kk[nk++] = fpv[0];
+	    ops[i++] = (struct traceOp) { fpv[0], FP64SET_TRACE_ADD, rc };
+	    break;
+	case 1:
+	    rc = fp64set_has(set, fpv[0]);
+	    ops[i++] = (struct traceOp) { fpv[0], FP64SET_TRACE_HAS, rc };
+	    break;
+	default:
+	    fp64set_has_batch(set, fpv, m, out);
+	    for (size_t j = 0; j < m; j++)
+		ops[i++] = (struct traceOp) { fpv[j], FP64SET_TRACE_HAS, out[j] };
+	}
+    }
+    pthread_t tid[nthr];
+    struct traceThread ta[nthr];
+    for (size_t t = 0; t < nthr; t++) {
+	ta[t] = (struct traceThread) { set, kk, nt };
+	rc = pthread_create(&tid[t], NULL, traceThread, &ta[t]);
+	assert(rc == 0);
+    }
+    for (size_t t = 0; t < nthr; t++)
+	pthread_join(tid[t], NULL);
+    rc = fp64set_trace(set, NULL);
+    assert(rc == 0);
+
+    // Read the trace back.
+    size_t nrec = n0 + nops + nthr * nt, bad = 0;
+    unsigned char *rec = malloc(nrec * FP64SET_TRACE_RECSIZE + 1);
+    assert(rec);
+    struct fp64set_trace_header h;
+    FILE *fp = fopen(fname, "rb");
+    assert(fp);
+    bad += fread(&h, sizeof h, 1, fp) != 1;
+    bad += fread(rec, FP64SET_TRACE_RECSIZE, nrec + 1, fp) != nrec;
+    fclose(fp);
+    unlink(fname);
+    bad += memcmp(h.magic, "fp64trc1", 8) || h.logsize != logsize0 ||
+	    h.stash != FP64SET_STASH;
+    struct fp64set *set2 = fp64set_new(h.logsize);
+    for (size_t i = 0; i < nrec; i++) {
+	const unsigned char *p = rec + FP64SET_TRACE_RECSIZE * i;
+	int op = p[0] & 15, rc0 = (p[0] >> 4) - 1;
+	uint64_t fp;
+	memcpy(&fp, p + 1, sizeof fp);
+	if (i < n0) {
+	    bad += op != FP64SET_TRACE_LOAD || rc0 != 1;
+	    v[i] = fp;
+	    fp64set_add(set2, fp);
+	}
+	else if (i < n0 + nops) {
+	    const struct traceOp *o = &ops[i-n0];
+	    bad += op != o->op || rc0 != o->rc || fp != o->fp;
+	    rc = op == FP64SET_TRACE_ADD ? fp64set_add(set2, fp) : fp64set_has(set2, fp);
+	    bad += rc != rc0 && !(rc > 0 && rc0 > 0);
+	}
+	else {
+	    bad += op != FP64SET_TRACE_HAS || rc0 != 1;
+	    v[i-nops] = fp;
+	}
+    }
+    // The threads' lookups, in any order, each of them nthr times.
+    qsort(v + n0, nthr * nt, sizeof *v, cmpU64);
+    qsort(kk, nt, sizeof *kk, cmpU64);
+    for (size_t i = 0; i < nthr * nt; i++)
+	bad += v[n0+i] != kk[i/nthr];
+    // The contents, in any order.
+    qsort(v, n0, sizeof *v, cmpU64);
+    qsort(kk, n0, sizeof *kk, cmpU64);
+    bad += memcmp(v, kk, n0 * sizeof *v) != 0;
+    printf("trace %zu records %zu bad\n", nrec, bad);
+    fp64set_free(set);
+    fp64set_free(set2);
+    free(kk), free(v), free(ops), free(rec);
+    return bad == 0;
+}
+
+static void exportAppend(uint64_t fp, void *arg)
+{
+    uint64_t **p = arg;
+    *(*p)++ = fp;
+}
+
+// Export sets of random sizes, including the empty set and the sets with
+// stashed fingerprints, sorted and unsorted, and enumerate them with
+// fp64set_foreach().  Sorted by hand, the fingerprints which have been
+// added must come out, none missing and none twice.  Returns false
+// on a mismatch.
+bool check_export(int logsize)
+{
+    size_t maxk = 4 << logsize;
+    uint64_t *kk = malloc(maxk * sizeof *kk);
+    uint64_t *out = malloc(maxk * sizeof *out);
+    assert(kk && out);
+    size_t n = 0, bad = 0;
+    for (int r = 0; r < 64; r++) {
+	struct fp64set *set = fp64set_new(r % 2 ? 4 : logsize);
+	size_t nk = r > 1 ? rnd() % maxk : 0;
+	for (size_t i = 0; i < nk; i++) {
+	    kk[i] = rnd();
+	    int rc = fp64set_add(set, kk[i]);
+	    assert(rc > 0);
+	}
+	qsort(kk, nk, sizeof *kk, cmpU64);
+	n += 3 * nk;
+	bad += fp64set_size(set) != nk;
+	// Sorted.
+	bad += fp64set_export(set, out, true) != nk;
+	bad += memcmp(out, kk, nk * sizeof *kk) != 0;
+	// Unsorted, in any order.
+	bad += fp64set_export(set, out, false) != nk;
+	qsort(out, nk, sizeof *out, cmpU64);
+	bad += memcmp(out, kk, nk * sizeof *kk) != 0;
+	// Enumerated.
+	uint64_t *p = out;
+	fp64set_foreach(set, exportAppend, &p);
+	bad += (size_t)(p - out) != nk;
+	qsort(out, nk, sizeof *out, cmpU64);
+	bad += memcmp(out, kk, nk * sizeof *kk) != 0;
+	fp64set_free(set);
+    }
+    free(kk), free(out);
+    printf("export %zu fingerprints %zu bad\n", n, bad);
+    return bad == 0;
+}
+
+static struct fp64set *algSet(int logsize, const uint64_t *kk, size_t n)
+{
+    struct fp64set *set = fp64set_new(logsize);
+    assert(set);
+    for (size_t i = 0; i < n; i++) {
+	int rc = fp64set_add(set, kk[i]);
+	assert(rc >= 0);
+    }
+    return set;
+}
+
+// Set algebra by a merge-walk of two sorted arrays: op 0 is the union,
+// 1 the intersection, 2 the difference.  Returns the size of the result.
+static size_t algMerge(int op, const uint64_t *a, size_t na,
+	const uint64_t *b, size_t nb, uint64_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+    while (i < na || j < nb) {
+	if (j == nb || (i < na && a[i] < b[j])) {
+	    if (op != 1)
+		out[n++] = a[i];
+	    i++;
+	}
+	else if (i == na || b[j] < a[i]) {
+	    if (op == 0)
+		out[n++] = b[j];
+	    j++;
+	}
+	else {
+	    if (op != 2)
+		out[n++] = a[i];
+	    i++, j++;
+	}
+    }
+    return n;
+}
+
+// The union, the intersection and the difference of two sets which share
+// some of the fingerprints, in the same layout and in different ones, in
+// place and into a new set, single- and multi-threaded, must come out the
+// same as by merging the sorted exports.  Returns false on a mismatch.
+bool check_algebra(int logsize)
+{
+    size_t maxk = 4 << logsize;
+    uint64_t *ka = malloc(maxk * sizeof *ka), *kb = malloc(maxk * sizeof *kb);
+    uint64_t *ea = malloc(maxk * sizeof *ea), *eb = malloc(maxk * sizeof *eb);
+    uint64_t *ref = malloc(2 * maxk * sizeof *ref);
+    uint64_t *out = malloc(2 * maxk * sizeof *out);
+    assert(ka && kb && ea && eb && ref && out);
+    size_t n = 0, bad = 0;
+    for (int r = 0; r < 32; r++) {
+	// Different layouts every other round.
+	int logb = r % 2 ? logsize + 1 : logsize;
+	size_t na = rnd() % maxk, nb = rnd() % maxk;
+	for (size_t i = 0; i < na; i++)
+	    ka[i] = rnd();
+	for (size_t j = 0; j < nb; j++)
+	    kb[j] = na && rnd() % 2 ? ka[rnd() % na] : rnd();
+	struct fp64set *b = algSet(logb, kb, nb);
+	nb = fp64set_export(b, eb, true);
+	struct fp64set *a = algSet(logsize, ka, r ? rnd() % maxk : 0);
+	na = fp64set_export(a, ea, true);
+	fp64set_free(a);
+	for (int op = 0; op < 3; op++)
+	    for (int v = 0; v < 4; v++) {
+		// In place or not, with 1 or 4 threads.
+		bool inplace = v & 1;
+		int nthr = v & 2 ? 4 : 1;
+		if (op == 0 && nthr > 1)
+		    continue;
+		a = algSet(logsize, ea, na);
+		struct fp64set *dst = inplace ? a : fp64set_new(logsize);
+		assert(dst);
+		int rc;
+		switch (op) {
+		case 0: rc = fp64set_union(dst, a, b); break;
+		case 1:
+		    rc = nthr > 1 ? fp64set_intersect_mt(dst, a, b, nthr) :
+			    fp64set_intersect(dst, a, b);
+		    break;
+		default:
+		    rc = nthr > 1 ? fp64set_difference_mt(dst, a, b, nthr) :
+			    fp64set_difference(dst, a, b);
+		}
+		size_t nref = algMerge(op, ea, na, eb, nb, ref);
+		bad += rc != 0;
+		bad += fp64set_export(dst, out, true) != nref;
+		bad += memcmp(out, ref, nref * sizeof *ref) != 0;
+		n += nref;
+		if (dst != a)
+		    fp64set_free(dst);
+		fp64set_free(a);
+	    }
+	fp64set_free(b);
+    }
+    free(ka), free(kb), free(ea), free(eb), free(ref), free(out);
+    printf("algebra %zu fingerprints %zu bad\n", n, bad);
+    return bad == 0;
+}
+
+struct cloneReader {
+    struct fp64set_pub *pub;
+    const uint64_t *kk;
+    size_t nk, n, bad;
+};
+
+// Each set published holds a prefix of kk, and nothing else.  The reader
+// is done once it has seen the whole of kk.
+static void *cloneReader(void *arg)
+{
+    struct cloneReader *a = arg;
+    size_t m = 0;
+    while (m < a->nk) {
+	const struct fp64set *set = fp64set_acquire(a->pub);
+	if (!set) {
+	    sched_yield();
+	    continue;
+	}
+	m = fp64set_size(set);
+	for (size_t i = 0; i < m; i++, a->n++)
+	    a->bad += !fp64set_has(set, a->kk[i]);
+	a->bad += fp64set_has(set, a->kk[m]);
+	fp64set_release(a->pub, set);
+    }
+    return NULL;
+}
+
+// A clone must have the same fingerprints, the same bucket images, and
+// the same answers as the original, with or without the prefilter; once
+// made, the clone and the original are modified independently.  Then a
+// growing set is cloned and published while the readers look up the
+// snapshots they acquire.  Returns false on a mismatch.
+bool check_clone(int logsize)
+{
+    size_t maxk = 4 << logsize;
+    uint64_t *kk = malloc((maxk + 1) * sizeof *kk);
+    uint64_t *e1 = malloc(maxk * sizeof *e1), *e2 = malloc(maxk * sizeof *e2);
+    assert(kk && e1 && e2);
+    size_t n = 0, bad = 0;
+    for (int r = 0; r < 16; r++) {
+	struct fp64set *set = fp64set_new(logsize);
+	size_t nk = r ? rnd() % maxk : 0;
+	for (size_t i = 0; i < nk; i++) {
+	    kk[i] = rnd();
+	    int rc = fp64set_add(set, kk[i]);
+	    assert(rc > 0);
+	}
+	if (r % 2) {
+	    int rc = fp64set_prefilter(set, 8);
+	    assert(rc == 0);
+	}
+	struct fp64set *clone = fp64set_clone(set);
+	assert(clone);
+	size_t nb = set->bsize * (set->mask + 1) * sizeof(uint64_t);
+	bad += clone->bb == set->bb || clone->logsize != set->logsize ||
+		clone->bsize != set->bsize || memcmp(clone->bb, set->bb, nb);
+	bad += fp64set_export(set, e1, true) != nk;
+	bad += fp64set_export(clone, e2, true) != nk;
+	bad += memcmp(e1, e2, nk * sizeof *e1) != 0;
+	for (size_t i = 0; i < maxk; i++, n++) {
+	    uint64_t fp = i < nk ? kk[i] : rnd();
+	    bad += fp64set_has(clone, fp) != fp64set_has(set, fp);
+	}
+	// Independent: what is added to one is not in the other.
+	uint64_t fp1 = rnd(), fp2 = rnd();
+	bad += fp64set_add(set, fp1) <= 0 || fp64set_add(clone, fp2) <= 0;
+	bad += fp64set_has(clone, fp1) || fp64set_has(set, fp2);
+	bad += fp64set_size(set) != nk + 1 || fp64set_size(clone) != nk + 1;
+	fp64set_free(set);
+	fp64set_free(clone);
+    }
+
+    // Publish.
+    for (size_t i = 0; i <= maxk; i++)
+	kk[i] = rnd();
+    struct fp64set_pub *pub = fp64set_pub_new();
+    assert(pub);
+    int nthr = 4;
+    pthread_t tid[nthr];
+    struct cloneReader ra[nthr];
+    for (int t = 0; t < nthr; t++) {
+	ra[t] = (struct cloneReader) { pub, kk, maxk, 0, 0 };
+	int rc = pthread_create(&tid[t], NULL, cloneReader, &ra[t]);
+	assert(rc == 0);
+    }
+    struct fp64set *set = fp64set_new(logsize);
+    size_t npub = 0;
+    for (size_t i = 0; i < maxk; i++) {
+	int rc = fp64set_add(set, kk[i]);
+	assert(rc > 0);
+	if (rnd() % 64 == 0 || i == maxk - 1) {
+	    struct fp64set *clone = fp64set_clone(set);
+	    assert(clone);
+	    rc = fp64set_publish(pub, clone);
+	    assert(rc == 0);
+	    npub++;
+	    // Let the readers in, even with a single CPU.
+	    sched_yield();
+	}
+    }
+    fp64set_free(set);
+    for (int t = 0; t < nthr; t++) {
+	pthread_join(tid[t], NULL);
+	n += ra[t].n, bad += ra[t].bad;
+    }
+    // The last snapshot is still there, with all of kk.
+    const struct fp64set *last = fp64set_acquire(pub);
+    bad += !last || fp64set_size(last) != maxk;
+    if (last)
+	fp64set_release(pub, last);
+    fp64set_pub_free(pub);
+    free(kk), free(e1), free(e2);
+    printf("clone %zu lookups %zu published %zu bad\n", n, npub, bad);
+    return bad == 0;
+}
+
+// Look up the keys, and as many random fingerprints, in the set attached
+// from shared memory; returns the number of answers which differ from set.
+static size_t shmLookups(const struct fp64set *shm, const struct fp64set *set,
+	const uint64_t *kk, size_t nk, size_t *n)
+{
+    size_t bad = 0;
+    for (size_t i = 0; i < 2 * nk; i++, (*n)++) {
+	uint64_t fp = i < nk ? kk[i] : rnd();
+	bad += fp64set_has(shm, fp) != fp64set_has(set, fp);
+    }
+    return bad;
+}
+
+// Put sets into shared memory, with and without the prefilter, and
+// attach them, in this process and in a child process: the lookups must
+// come out the same as in the original set.  Creating the segment a
+// second time must fail with EEXIST, and attaching it once it has been
+// unlinked, with ENOENT.  Returns false on a mismatch.
+bool check_shm(int logsize)
+{
+    char name[64];
+    snprintf(name, sizeof name, "/bench-fp64set-%d", (int) getpid());
+    size_t maxk = 4 << logsize;
+    uint64_t *kk = malloc(maxk * sizeof *kk);
+    assert(kk);
+    size_t n = 0, bad = 0;
+    for (int r = 0; r < 8; r++) {
+	struct fp64set *set = fp64set_new(logsize);
+	size_t nk = r ? rnd() % maxk : 0;
+	for (size_t i = 0; i < nk; i++) {
+	    kk[i] = rnd();
+	    int rc = fp64set_add(set, kk[i]);
+	    assert(rc > 0);
+	}
+	if (r % 2) {
+	    int rc = fp64set_prefilter(set, 8);
+	    assert(rc == 0);
+	}
+	int rc = fp64set_create_shm(set, name);
+	assert(rc == 0);
+	bad += fp64set_create_shm(set, name) != -1 || errno != EEXIST;
+	const struct fp64set *shm = fp64set_attach_shm(name);
+	assert(shm);
+	bad += fp64set_size(shm) != nk;
+	bad += shmLookups(shm, set, kk, nk, &n);
+	fp64set_detach_shm(shm);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+	    shm = fp64set_attach_shm(name);
+	    if (!shm)
+		_exit(2);
+	    size_t cbad = shmLookups(shm, set, kk, nk, &n);
+	    fp64set_detach_shm(shm);
+	    _exit(cbad != 0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	bad += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	n += 2 * nk;
+	shm_unlink(name);
+	bad += fp64set_attach_shm(name) != NULL || errno != ENOENT;
+	fp64set_free(set);
+    }
+    free(kk);
+    printf("shm %zu lookups %zu bad\n", n, bad);
+    return bad == 0;
+}
+
+// Run windowed sets of a few window sizes for 256 generations, adding
+// random picks from a pool of fingerprints, while keeping for each of them
+// the generation in which it was last added.  Each add must tell whether
+// the fingerprint was still fresh, and after each generation, the whole
+// pool is looked up.  Returns false on a mismatch.
+bool check_window(int logsize)
+{
+    size_t pool = 2 << logsize;
+    uint64_t *kk = malloc(pool * sizeof *kk);
+    uint32_t *last = malloc(pool * sizeof *last);
+    bool *added = malloc(pool);
+    assert(kk && last && added);
+    for (size_t i = 0; i < pool; i++)
+	kk[i] = rnd();
+    size_t n = 0, bad = 0;
+    uint32_t windows[] = { 1, 2, 8, 64 };
+    for (int k = 0; k < 4; k++) {
+	uint32_t window = windows[k];
+	struct fp64set_window *w = fp64set_window_new(logsize, window);
+	assert(w);
+	memset(added, 0, pool);
+	// About 1<<logsize fingerprints alive at a time.
+	size_t nadd = ((size_t) 1 << logsize) / window + 1;
+	for (int g = 0; g < 256; g++) {
+	    for (size_t j = 0; j < nadd; j++, n++) {
+		size_t i = rnd() % pool;
+		bool fresh = added[i] && w->gen - last[i] < window;
+		int rc = fp64set_window_add(w, kk[i]);
+		assert(rc >= 0);
+		bad += (rc == 0) != fresh;
+		added[i] = true, last[i] = w->gen;
+	    }
+	    for (size_t i = 0; i < pool; i++, n++) {
+		bool fresh = added[i] && w->gen - last[i] < window;
+		bad += fp64set_window_has(w, kk[i]) != fresh;
+	    }
+	    fp64set_window_advance(w);
+	}
+	// Nothing survives a whole window without adds.
+	for (uint32_t g = 0; g < window; g++)
+	    fp64set_window_advance(w);
+	for (size_t i = 0; i < pool; i++, n++)
+	    bad += fp64set_window_has(w, kk[i]);
+	fp64set_window_free(w);
+    }
+    free(kk), free(last), free(added);
+    printf("window %zu checks %zu bad\n", n, bad);
+    return bad == 0;
+}
+
+// By the count in descending order, then by the fingerprint.
+static int cmpCount(const void *a, const void *b)
+{
+    const struct fp64set_count *x = a, *y = b;
+    if (x->count != y->count)
+	return x->count < y->count ? 1 : -1;
+    return (x->fp > y->fp) - (x->fp < y->fp);
+}
+
+// Count skewed picks from a pool of fingerprints, starting small so that
+// the counter grows, along with the reference counts.  Each add must return
+// the new count, and the counts of the whole pool are then read back.  The
+// exports, with a few thresholds and limits, must come out in the same
+// order as the reference sorted by qsort.  Returns false on a mismatch.
+bool check_counter(int logsize)
+{
+    size_t pool = 2 << logsize;
+    uint64_t *kk = malloc(pool * sizeof *kk);
+    uint32_t *ref = calloc(pool, sizeof *ref);
+    struct fp64set_count *rv = malloc(pool * sizeof *rv);
+    struct fp64set_count *out = malloc(pool * sizeof *out);
+    assert(kk && ref && rv && out);
+    for (size_t i = 0; i < pool; i++)
+	kk[i] = rnd();
+    struct fp64set_counter *c = fp64set_counter_new(4);
+    assert(c);
+    size_t n = 0, bad = 0, nref = 0;
+    for (size_t j = 0; j < 4 * pool; j++, n++) {
+	// The lower indices are picked more often.
+	size_t i = rnd() % pool;
+	i = rnd() % (i + 1);
+	nref += ref[i]++ == 0;
+	bad += fp64set_counter_add(c, kk[i]) != ref[i];
+    }
+    bad += fp64set_counter_size(c) != nref;
+    size_t m = 0;
+    for (size_t i = 0; i < pool; i++, n++) {
+	bad += fp64set_counter_get(c, kk[i]) != ref[i];
+	bad += fp64set_counter_has(c, kk[i]) != (ref[i] > 0);
+	if (ref[i])
+	    rv[m++] = (struct fp64set_count) { kk[i], ref[i] };
+    }
+    qsort(rv, m, sizeof *rv, cmpCount);
+    uint32_t thresholds[] = { 0, 1, 2, rv[0].count, rv[0].count + 1 };
+    size_t kv[] = { 0, 1, 10, m / 2, SIZE_MAX };
+    for (int t = 0; t < 5; t++)
+	for (int k = 0; k < 5; k++, n++) {
+	    // The reference is the prefix of rv above the threshold.
+	    size_t nexp = 0;
+	    while (nexp < m && rv[nexp].count >= thresholds[t])
+		nexp++;
+	    if (nexp > kv[k])
+		nexp = kv[k];
+	    size_t nout = fp64set_counter_export(c, thresholds[t], out, kv[k]);
+	    bad += nout != nexp;
+	    for (size_t i = 0; i < nout && i < nexp; i++)
+		bad += out[i].fp != rv[i].fp || out[i].count != rv[i].count;
+	}
+    fp64set_counter_free(c);
+    free(kk), free(ref), free(rv), free(out);
+    printf("counter %zu checks %zu bad\n", n, bad);
+    return bad == 0;
+}
+
+// 128-bit fingerprints which share their halves: for each of the nh
+// halves lo[a], there are the pairs (lo[a], hi[a]) and (lo[a], hi[a+1]),
+// added in random order.  (The buckets are picked by the halves, so more
+// sharing would overflow them, just as with 64-bit fingerprints sharing
+// their 32-bit halves.)  The set must tell the pairs apart, and must not
+// find the pairs never added, such as (lo[a], hi[a+2]), nor the pairs
+// with the halves swapped.  Returns false on a mismatch.
+bool check_fp128(int logsize)
+{
+    size_t nh = (size_t) 2 << logsize;
+    uint64_t *lo = malloc(nh * sizeof *lo), *hi = malloc(nh * sizeof *hi);
+    bool *in = calloc(2 * nh, 1);
+    assert(lo && hi && in);
+    for (size_t i = 0; i < nh; i++)
+	lo[i] = rnd(), hi[i] = rnd();
+    struct fp128set *set = fp128set_new(4);
+    assert(set);
+    size_t n = 0, bad = 0, nk = 0;
+    for (int r = 0; r < 8; r++) {
+	for (size_t j = 0; j < nh / 2; j++, n++) {
+	    size_t k = rnd() % (2 * nh), a = k / 2, b = (a + k % 2) % nh;
+	    int rc = fp128set_add(set, lo[a], hi[b]);
+	    assert(rc >= 0);
+	    bad += (rc == 0) != in[k];
+	    nk += !in[k];
+	    in[k] = true;
+	}
+	bad += fp128set_size(set) != nk;
+	for (size_t a = 0; a < nh; a++, n += 5) {
+	    bad += fp128set_has(set, lo[a], hi[a]) != in[2*a];
+	    bad += fp128set_has(set, lo[a], hi[(a+1)%nh]) != in[2*a+1];
+	    bad += fp128set_has(set, lo[a], hi[(a+2)%nh]);
+	    bad += fp128set_has(set, hi[a], lo[a]);
+	    bad += fp128set_has(set, hi[(a+1)%nh], lo[a]);
+	}
+    }
+    fp128set_free(set);
+    free(lo), free(hi), free(in);
+    printf("fp128 %zu lookups %zu fingerprints %zu bad\n", n, nk, bad);
+    return bad == 0;
+}
+
+// Byte keys of 0 to 40 bytes, some of them repeated within a batch, are
+// added in batches to one set, and one by one to another: the return values
+// must agree (up to where the resizes fall), and so must the batched and
+// the single lookups, of these keys and of keys never added.  The set is
+// then reseeded, which must keep all the keys under a new seed.  Returns
+// false on a mismatch.
+bool check_bytes(int logsize)
+{
+    size_t nk = 2 << logsize, nb = 64;
+    unsigned char *buf = malloc(nk * 40 + 40);
+    const void **keys = malloc(2 * nk * sizeof *keys);
+    size_t *lens = malloc(2 * nk * sizeof *lens);
+    int *rc = malloc(nb * sizeof *rc);
+    bool *out = malloc(2 * nk * sizeof *out);
+    assert(buf && keys && lens && rc && out);
+    for (size_t i = 0; i < nk * 40 + 40; i++)
+	buf[i] = rnd();
+    // The first nk keys are added, the other nk are not.  Some of the
+    // former repeat one of the 32 keys before, often in the same batch.
+    for (size_t i = 0; i < 2 * nk; i++) {
+	size_t j = i;
+	if (i && i < nk && rnd() % 8 == 0)
+	    j = i - 1 - rnd() % (i < 32 ? i : 32);
+	keys[i] = buf + j * 20;
+	lens[i] = j == i ? rnd() % 41 : lens[j];
+    }
+    struct fp64set *set = fp64set_new(4), *ref = fp64set_new(4);
+    assert(set && ref);
+    size_t n = 0, bad = 0;
+    for (size_t i = 0; i < nk; i += nb) {
+	size_t m = nk - i < nb ? nk - i : nb;
+	bad += fp64set_add_bytes_batch(set, keys + i, lens + i, m, rc) != m;
+	for (size_t j = 0; j < m; j++, n++) {
+	    int rc0 = fp64set_add_bytes(ref, keys[i+j], lens[i+j]);
+	    bad += rc[j] != rc0 && !(rc[j] > 0 && rc0 > 0);
+	}
+    }
+    bad += fp64set_size(set) != fp64set_size(ref);
+    size_t nfound = fp64set_has_bytes_batch(set, keys, lens, 2 * nk, out);
+    size_t nfound0 = 0;
+    for (size_t i = 0; i < 2 * nk; i++, n++) {
+	bool has = fp64set_has_bytes(ref, keys[i], lens[i]);
+	bad += out[i] != has || (i < nk && !has);
+	nfound0 += has;
+    }
+    bad += nfound != nfound0;
+    // Reseed, all the keys are still there.
+    uint64_t seed0 = set->seed;
+    size_t size0 = fp64set_size(set);
+    bad += fp64set_reseed(set, keys, lens, nk) != 0;
+    bad += set->seed == seed0 || fp64set_size(set) != size0;
+    for (size_t i = 0; i < nk; i++, n++) {
+	bad += !fp64set_has_bytes(set, keys[i], lens[i]);
+	bad += !fp64set_has(set, fp64set_hash(keys[i], lens[i], set->seed));
+    }
+    fp64set_free(set);
+    fp64set_free(ref);
+    free(buf), free(keys), free(lens), free(rc), free(out);
+    printf("bytes %zu keys %zu bad\n", n, bad);
+    return bad == 0;
+}
+
+// Merge 4 sets, which share a part of their fingerprints, into a set
+// which holds some of them already, on 1 and on 4 threads.  The sources
+// are big enough for the parallel merge, except in the first round.  The
+// result must be the sorted, deduplicated concatenation of the exports.
+// The time of each merge is reported, in Mcycles; the source sets are
+// built anew for each merge, so that the caches start out the same.
+// Returns false on a mismatch.
+bool check_merge(int logsize)
+{
+    size_t nsrc = 4, maxk = (size_t) 16 << (logsize > 12 ? logsize : 12);
+    uint64_t *kk = malloc(maxk * sizeof *kk);
+    uint64_t *ref = malloc((nsrc + 1) * maxk * sizeof *ref);
+    uint64_t *out = malloc((nsrc + 1) * maxk * sizeof *out);
+    assert(kk && ref && out);
+    size_t n = 0, bad = 0;
+    uint64_t tv[2] = { 0, 0 };
+    for (int r = 0; r < 4; r++) {
+	size_t nk = r ? maxk : 256;
+	for (int t = 0; t < 2; t++) {
+	    // The same sets for both merges.
+	    uint64_t rnd0 = rndState;
+	    struct fp64set *dst = fp64set_new(logsize);
+	    struct fp64set *sv[nsrc];
+	    assert(dst);
+	    for (size_t i = 0; i < nk; i++)
+		kk[i] = rnd();
+	    for (size_t i = 0; r > 1 && i < nk / 4; i++)
+		fp64set_add(dst, kk[i]);
+	    for (size_t s = 0; s < nsrc; s++) {
+		sv[s] = fp64set_new(logsize);
+		assert(sv[s]);
+		// Half of them shared, half of them of its own.  The latter
+		// come from every other rnd() call, whose low state bits
+		// alternate, and so need mixing.
+		for (size_t i = 0; i < nk; i++) {
+		    int rc = fp64set_add(sv[s], i % 2 ? fmix64(rnd()) : kk[rnd() % nk]);
+		    assert(rc >= 0);
+		}
+	    }
+	    size_t nref = fp64set_export(dst, ref, false);
+	    for (size_t s = 0; s < nsrc; s++)
+		nref += fp64set_export(sv[s], ref + nref, false);
+	    qsort(ref, nref, sizeof *ref, cmpU64);
+	    size_t m = 0;
+	    for (size_t i = 0; i < nref; i++)
+		if (m == 0 || ref[i] != ref[m-1])
+		    ref[m++] = ref[i];
+	    uint64_t t0 = __rdtsc();
+	    int rc = fp64set_merge(dst, (const struct fp64set *const *) sv, nsrc, t ? 4 : 1);
+	    tv[t] += __rdtsc() - t0;
+	    bad += rc != 0;
+	    bad += fp64set_export(dst, out, true) != m;
+	    bad += memcmp(out, ref, m * sizeof *ref) != 0;
+	    n += m;
+	    for (size_t s = 0; s < nsrc; s++)
+		fp64set_free(sv[s]);
+	    fp64set_free(dst);
+	    if (t == 0)
+		rndState = rnd0;
+	}
+    }
+    free(kk), free(ref), free(out);
+    printf("merge %zu fps 1 thread %.2fM 4 threads %.2fM cycles %zu bad\n",
+	    n, tv[0] / 1e6, tv[1] / 1e6, bad);
+    return bad == 0;
+}
+
+// Checks rather than benchmarks, run by name, not included in ALL.
+static const struct {
+    const char *name;
+    bool (*fn)(int logsize);
+} checks[] = {
+    { "stash", check_stash },
+    { "frozen", check_frozen },
+    { "trace", check_trace },
+    { "export", check_export },
+    { "algebra", check_algebra },
+    { "clone", check_clone },
+    { "shm", check_shm },
+    { "window", check_window },
+    { "counter", check_counter },
+    { "fp128", check_fp128 },
+    { "bytes", check_bytes },
+    { "merge", check_merge },
+};
+
 int main(int argc, char **argv)
 {
     int nb = 10;
@@ -152,28 +1295,56 @@ int main(int argc, char **argv)
     ITER -= nb;
     bool ALL = argc <= 1;
     ITER += !ALL;
-    bool b_has2 = ALL, b_has3 = ALL, b_has4 = ALL;
+    bool b_has2 = ALL, b_has3 = ALL, b_has4 = ALL, b_hasf = ALL, b_hasr = ALL, b_hask = ALL;
+    bool b_cnt = ALL;
     bool b_add2u = ALL, b_add3u = ALL, b_add4u = ALL;
     bool b_add2d = ALL, b_add3d = ALL, b_add4d = ALL;
+    bool b_add2f = ALL, b_add3f = ALL, b_add4f = ALL;
+    // Not included in ALL, may need a lot of memory: "lat [MAXLOG]".
+    int maxlog = 0;
     for (int i = 1; !ALL && i < argc; i++) {
 	if (0) continue;
 	else if (strcmp(argv[i], "has") == 0) b_has2 = b_has3 = b_has4 = 1;
 	else if (strcmp(argv[i], "addu") == 0) b_add2u = b_add3u = b_add4u = 1;
 	else if (strcmp(argv[i], "addd") == 0) b_add2d = b_add3d = b_add4d = 1;
+	else if (strcmp(argv[i], "addf") == 0) b_add2f = b_add3f = b_add4f = 1;
 	else if (strcmp(argv[i], "has2") == 0) b_has2 = 1;
 	else if (strcmp(argv[i], "has3") == 0) b_has3 = 1;
 	else if (strcmp(argv[i], "has4") == 0) b_has4 = 1;
+	else if (strcmp(argv[i], "hasf") == 0) b_hasf = 1;
+	else if (strcmp(argv[i], "hasr") == 0) b_hasr = 1;
+	else if (strcmp(argv[i], "hask") == 0) b_hask = 1;
+	else if (strcmp(argv[i], "cnt") == 0) b_cnt = 1;
+	else if (strcmp(argv[i], "lat") == 0) {
+	    maxlog = nb + 2;
+	    if (i + 1 < argc && argv[i+1][0] >= '0' && argv[i+1][0] <= '9')
+		maxlog = atoi(argv[++i]);
+	    assert(maxlog >= nb && maxlog <= 28);
+	}
 	else if (strcmp(argv[i], "add2u") == 0) b_add2u = 1;
 	else if (strcmp(argv[i], "add3u") == 0) b_add3u = 1;
 	else if (strcmp(argv[i], "add4u") == 0) b_add4u = 1;
 	else if (strcmp(argv[i], "add2d") == 0) b_add2d = 1;
 	else if (strcmp(argv[i], "add3d") == 0) b_add3d = 1;
 	else if (strcmp(argv[i], "add4d") == 0) b_add4d = 1;
+	else if (strcmp(argv[i], "add2f") == 0) b_add2f = 1;
+	else if (strcmp(argv[i], "add3f") == 0) b_add3f = 1;
+	else if (strcmp(argv[i], "add4f") == 0) b_add4f = 1;
     }
     double t, f;
     if (b_add2u) t = bench_addUniq(2, nb, &f), printf("add2 uniq %.2f %.1f%%\n", t, f);
     if (b_add3u) t = bench_addUniq(3, nb, &f), printf("add3 uniq %.2f %.1f%%\n", t, f);
     if (b_add4u) t = bench_addUniq(4, nb, &f), printf("add4 uniq %.2f %.1f%%\n", t, f);
+    // Beyond 85% or 90% fill, with the eviction costs, FP64SET_BFS=0 vs 1.
+    // The iterations which resize before that fill are skipped.
+    for (int bsize = 2; bsize <= 4; bsize++) {
+	if (!(bsize == 2 ? b_add2f : bsize == 3 ? b_add3f : b_add4f))
+	    continue;
+	int skipped;
+	t = bench_addFull(bsize, nb, &skipped);
+	printf("add%d full %.2f >%.0f%% skipped %d/%d\n", bsize, t,
+		100 * fullFill(bsize), skipped, 1 << ITER);
+    }
     // NB: dups incur extra costs of fmix64.
     if (b_add2d) printf("add2 dups %.2f\n", bench_addDups(2, nb));
     if (b_add3d) printf("add3 dups %.2f\n", bench_addDups(3, nb));
@@ -181,5 +1352,30 @@ int main(int argc, char **argv)
     if (b_has2) printf("has2 %.2f\n", bench_has(2, nb));
     if (b_has3) printf("has3 %.2f\n", bench_has(3, nb));
     if (b_has4) printf("has4 %.2f\n", bench_has(4, nb));
-    return 0;
+    if (b_hasf) t = bench_hasFrozen(nb, &f), printf("hasf %.2f %.2fB/fp\n", t, f);
+    // Hit ratios: plain, prefiltered, prefiltered in batches.
+    int hitv[] = { 0, 5, 50, 100 };
+    for (int i = 0; b_hasr && i < 4; i++) {
+	double tv[3];
+	bench_hasRatio(nb, hitv[i], tv);
+	printf("has hit=%d%% %.2f filter %.2f batch %.2f\n", hitv[i], tv[0], tv[1], tv[2]);
+    }
+    // The kernels: C, branchy C, SSE4, and the one autotuning picks.
+    for (int i = 0; b_hask && i < 4; i++) {
+	double tv[3];
+	int k = bench_hasKernel(nb, hitv[i], tv);
+	printf("has hit=%d%% c %.2f branchy %.2f sse4 %.2f tuned %d\n", hitv[i], tv[0], tv[1], tv[2], k);
+    }
+    if (b_cnt) {
+	double tv[4];
+	bench_counter(nb, tv);
+	printf("cnt add %.2f window add %.2f get %.2f has %.2f\n", tv[0], tv[1], tv[2], tv[3]);
+    }
+    if (maxlog) bench_addLat(nb, maxlog);
+    int status = 0;
+    for (int i = 1; !ALL && i < argc; i++)
+	for (size_t j = 0; j < sizeof checks / sizeof *checks; j++)
+	    if (strcmp(argv[i], checks[j].name) == 0 && !checks[j].fn(nb))
+		status = 1;
+    return status;
 }
@@ -0,0 +1,405 @@
+// Copyright (c) 2017, 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "fp128set.h"
+
+#if FP128SET_STASH < 1 || FP128SET_STASH > 8
+#error "FP128SET_STASH must be 1..8"
+#endif
+
+// The design follows fp64set.c, which see for the rationale; only the
+// differences are commented here.  A slot is two 64-bit words, lo and hi.
+// The buckets are indexed by the low bits of either half.
+#define Hash1(lo, hi, mask) ((lo) & mask)
+#define Hash2(lo, hi, mask) ((hi) & mask)
+#define dFP2IB(lo, hi, bb, mask)		\
+    size_t i1 = Hash1(lo, hi, mask);		\
+    size_t i2 = Hash2(lo, hi, mask);		\
+    uint64_t *b1 = bb + 2 * bsize * i1;		\
+    uint64_t *b2 = bb + 2 * bsize * i2
+
+#define unlikely(cond) __builtin_expect(cond, 0)
+
+// The inline functions below rely heavily on constant propagation.
+#define inline inline __attribute__((always_inline))
+
+// A slot is compared in a single step: with SSE2, pcmpeqd yields all ones
+// iff all four dwords are equal, which pmovmskb turns into 0xffff.  SSE2
+// is the baseline on x86_64, so unlike fp64set, no runtime dispatch.
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define dKey(lo, hi) __m128i key = _mm_set_epi64x(hi, lo)
+#define Match(s) \
+    (_mm_movemask_epi8(_mm_cmpeq_epi32(key, _mm_loadu_si128((const __m128i *) (s)))) == 0xffff)
+#else
+#define dKey(lo, hi) uint64_t klo = lo, khi = hi
+#define Match(s) ((((s)[0] ^ klo) | ((s)[1] ^ khi)) == 0)
+#endif
+
+// Check if a fingerprint has already been inserted, branchless.
+static inline int has(uint64_t lo, uint64_t hi, const uint64_t *b1, const uint64_t *b2,
+	bool nstash, const uint64_t *stash, int bsize)
+{
+    dKey(lo, hi);
+    int has1 = Match(b1 + 0);
+    int has2 = Match(b2 + 0);
+    if (nstash)
+	for (int j = 0; j < FP128SET_STASH; j++)
+	    has1 |= Match(stash + 2 * j);
+    for (int j = 1; j < bsize; j++) {
+	has1 |= Match(b1 + 2 * j);
+	has2 |= Match(b2 + 2 * j);
+    }
+    return has1 | has2;
+}
+
+// Template for set->has virtual functions.
+static inline int t_has(const struct fp128set *set, uint64_t lo, uint64_t hi,
+	bool nstash, int bsize)
+{
+    dFP2IB(lo, hi, set->bb, set->mask);
+    return has(lo, hi, b1, b2, nstash, set->stash, bsize);
+}
+
+// Instantiate generic functions, only prototypes for now.
+#define MakeVFuncs(BS, ST) \
+    static int fp128set_add##BS##st##ST(uint64_t lo, uint64_t hi, struct fp128set *set); \
+    static int fp128set_has##BS##st##ST(uint64_t lo, uint64_t hi, const struct fp128set *set);
+#define MakeAllVFuncs	\
+    MakeVFuncs(2, 0)	\
+    MakeVFuncs(2, 1)	\
+    MakeVFuncs(3, 0)	\
+    MakeVFuncs(3, 1)	\
+    MakeVFuncs(4, 0)	\
+    MakeVFuncs(4, 1)
+MakeAllVFuncs
+
+#define SetVFuncs(set, BS, ST)				\
+do {							\
+    set->add = fp128set_add##BS##st##ST;		\
+    set->has = fp128set_has##BS##st##ST;		\
+} while (0)
+
+// In case BS is not a literal.
+#define SelectVFuncs(set, BS, ST)			\
+do {							\
+    if (BS == 2)					\
+	SetVFuncs(set, 2, ST);				\
+    else if (BS == 3)					\
+	SetVFuncs(set, 3, ST);				\
+    else						\
+	SetVFuncs(set, 4, ST);				\
+} while (0)
+
+// The blank value: both halves of a free slot are UINT64_MAX in bb[0][*],
+// and 0 elsewhere.  A fingerprint equal to the blank hashes elsewhere.
+static inline bool freeSlot(const uint64_t *s, size_t i)
+{
+    uint64_t blank = 0 - (uint64_t) (i == 0);
+    return s[0] == blank && s[1] == blank;
+}
+
+// Allocate the buckets and initialize the free slots.
+static uint64_t *makeBuckets(int logsize, int bsize)
+{
+    // The limit on 32-bit platforms is 2GB.
+    if (logsize + bsize > 28 && sizeof(size_t) < 5)
+	return errno = ENOMEM, NULL;
+    size_t nb = (size_t) 1 << logsize;
+    uint64_t *bb = calloc(2 * bsize * nb, sizeof(uint64_t));
+    if (bb)
+	memset(bb, 0xff, 2 * bsize * sizeof(uint64_t));
+    return bb;
+}
+
+struct fp128set *fp128set_new(int logsize)
+{
+    assert(logsize >= 0);
+    if (logsize < 4)
+	logsize = 4;
+    // Two 32-bit hash values out of each fingerprint, as in fp64set.
+    if (logsize > 32)
+	return errno = E2BIG, NULL;
+    uint64_t *bb = makeBuckets(logsize, 2);
+    if (!bb)
+	return NULL;
+    struct fp128set *set = malloc(sizeof *set);
+    if (!set)
+	return free(bb), NULL;
+    SetVFuncs(set, 2, 0);
+    memset(set->stash, 0, sizeof set->stash);
+    set->bb = bb;
+    set->cnt = 0;
+    set->mask = ((size_t) 1 << logsize) - 1;
+    set->logsize = logsize;
+    set->bsize = 2;
+    set->nstash = 0;
+    return set;
+}
+
+void fp128set_free(struct fp128set *set)
+{
+    if (!set)
+	return;
+#ifdef FP64SET_DEBUG
+    // The number of fingerprints must match the occupied slots.
+    size_t cnt = 0;
+    size_t mask = set->mask;
+    int bsize = set->bsize;
+    for (size_t i = 0; i <= mask; i++) {
+	uint64_t *b = set->bb + 2 * bsize * i;
+	for (int j = 0; j < bsize; j++) {
+	    uint64_t *s = b + 2 * j;
+	    if (freeSlot(s, i))
+		continue;
+	    assert(i == Hash1(s[0], s[1], mask) || i == Hash2(s[0], s[1], mask));
+	    cnt++;
+	}
+    }
+    assert(set->cnt == cnt);
+#endif
+    free(set->bb);
+    free(set);
+}
+
+static inline void putSlot(uint64_t *s, uint64_t lo, uint64_t hi)
+{
+    s[0] = lo, s[1] = hi;
+}
+
+// Add an element to either of its buckets, preferably to the least loaded.
+static inline bool justAdd2(uint64_t lo, uint64_t hi, uint64_t *b1, size_t i1,
+	uint64_t *b2, size_t i2, int bsize)
+{
+    for (int j = 0; j < bsize; j++) {
+	if (freeSlot(b1 + 2 * j, i1)) return putSlot(b1 + 2 * j, lo, hi), true;
+	if (freeSlot(b2 + 2 * j, i2)) return putSlot(b2 + 2 * j, lo, hi), true;
+    }
+    return false;
+}
+
+// Add an element to one bucket (because the other is known to be full).
+static inline bool justAdd1(uint64_t lo, uint64_t hi, uint64_t *b, size_t i, int bsize)
+{
+    for (int j = 0; j < bsize; j++)
+	if (freeSlot(b + 2 * j, i))
+	    return putSlot(b + 2 * j, lo, hi), true;
+    return false;
+}
+
+// The random walk, put at the top, kick out from the bottom.  Returns
+// false with the kicked-out fingerprint in *olo and *ohi.
+static inline bool kickAdd(uint64_t lo, uint64_t hi, uint64_t *bb, uint64_t *b, size_t i,
+	uint64_t *olo, uint64_t *ohi, int logsize, size_t mask, int bsize)
+{
+    int maxkick = logsize << 1;
+    do {
+	uint64_t klo = b[0], khi = b[1];
+	memmove(b, b + 2, 2 * (bsize - 1) * sizeof(uint64_t));
+	putSlot(b + 2 * (bsize - 1), lo, hi);
+	lo = klo, hi = khi;
+	// Find out the alternative bucket.
+	size_t i1 = Hash1(lo, hi, mask);
+	if (i == i1)
+	    i = Hash2(lo, hi, mask);
+	else
+	    i = i1;
+	b = bb + 2 * bsize * i;
+	if (justAdd1(lo, hi, b, i, bsize))
+	    return true;
+    } while (maxkick-- > 0);
+    *olo = lo, *ohi = hi;
+    return false;
+}
+
+// Insert the fingerprints from the array; the homeless ones are placed
+// back at the start of the array.  Returns the number of homeless ones.
+static inline size_t insertloop(uint64_t *bb, size_t nswap, uint64_t *swap,
+	int logsize, size_t mask, int bsize)
+{
+    size_t nout = 0;
+    for (size_t k = 0; k < nswap; k++) {
+	uint64_t lo = swap[2*k+0], hi = swap[2*k+1];
+	dFP2IB(lo, hi, bb, mask);
+	if (justAdd2(lo, hi, b1, i1, b2, i2, bsize))
+	    continue;
+	if (kickAdd(lo, hi, bb, b1, i1, &lo, &hi, logsize, mask, bsize))
+	    continue;
+	putSlot(swap + 2 * nout++, lo, hi);
+    }
+    return nout;
+}
+
+// The first n elements of the stash are valid: pad the unused slots
+// with copies of stash[0], and switch vfuncs accordingly.
+static void restash(struct fp128set *set, size_t n)
+{
+    for (size_t j = n; j < FP128SET_STASH; j++)
+	putSlot(set->stash + 2 * j, set->stash[0], set->stash[1]);
+    set->nstash = n;
+    if (n)
+	SelectVFuncs(set, set->bsize, 1);
+    else
+	SelectVFuncs(set, set->bsize, 0);
+}
+
+// Give the stashed elements another chance, see unstash() in fp64set.c,
+// then stash the homeless fingerprint.
+static inline bool t_stash(struct fp128set *set, uint64_t lo, uint64_t hi, int bsize)
+{
+    size_t n = set->nstash;
+    if (n) {
+	// The evictions may replace a stashed fingerprint with another one,
+	// so the padding must be redone even if none has found a home.
+	size_t nout = insertloop(set->bb, n, set->stash, set->logsize, set->mask, bsize);
+	set->cnt += n - nout;
+	restash(set, nout);
+    }
+    if (set->nstash < FP128SET_STASH) {
+	set->cnt--;
+	putSlot(set->stash + 2 * set->nstash, lo, hi);
+	restash(set, set->nstash + 1);
+	return true;
+    }
+    return false;
+}
+
+// Place a fingerprint into the new buckets being built, or else into out[],
+// which has room for FP128SET_STASH fingerprints.
+static inline bool reput(uint64_t lo, uint64_t hi, uint64_t *bb, int logsize, size_t mask,
+	int bsize, uint64_t *out, size_t *nout)
+{
+    dFP2IB(lo, hi, bb, mask);
+    if (justAdd2(lo, hi, b1, i1, b2, i2, bsize))
+	return true;
+    if (kickAdd(lo, hi, bb, b1, i1, &lo, &hi, logsize, mask, bsize))
+	return true;
+    if (*nout == FP128SET_STASH)
+	return false;
+    putSlot(out + 2 * (*nout)++, lo, hi);
+    return true;
+}
+
+// Unlike fp64set, which reinterprets the buckets in place, the set is
+// rebuilt from scratch with the new geometry: the homeless fingerprint,
+// the ones in the old buckets, and the stashed ones are inserted anew.
+// Returns 1 on success, 0 if the stash overflows, -1 on malloc failure.
+static inline int t_rebuild(struct fp128set *set, uint64_t lo, uint64_t hi,
+	int logsize, int bsize)
+{
+    uint64_t *bb = makeBuckets(logsize, bsize);
+    if (!bb)
+	return -1;
+    size_t mask = ((size_t) 1 << logsize) - 1;
+    uint64_t out[2*FP128SET_STASH];
+    size_t nout = 0;
+    bool ok = reput(lo, hi, bb, logsize, mask, bsize, out, &nout);
+    size_t omask = set->mask;
+    int obsize = set->bsize;
+    for (size_t i = 0; ok && i <= omask; i++) {
+	const uint64_t *b = set->bb + 2 * obsize * i;
+	for (int j = 0; ok && j < obsize; j++)
+	    if (!freeSlot(b + 2 * j, i))
+		ok = reput(b[2*j+0], b[2*j+1], bb, logsize, mask, bsize, out, &nout);
+    }
+    for (size_t j = 0; ok && j < set->nstash; j++)
+	ok = reput(set->stash[2*j+0], set->stash[2*j+1], bb, logsize, mask, bsize, out, &nout);
+    if (!ok)
+	return free(bb), 0;
+    // The homeless fingerprint has already been counted in set->cnt.
+    set->cnt = set->cnt + set->nstash - nout;
+    free(set->bb);
+    set->bb = bb;
+    set->mask = mask;
+    set->logsize = logsize;
+    set->bsize = bsize;
+    memcpy(set->stash, out, 2 * nout * sizeof(uint64_t));
+    restash(set, nout);
+    return 1;
+}
+
+// Grow the set through the same geometries as fp64set: the buckets get
+// 3 and then 4 slots, then the number of buckets doubles, with 3 slots
+// each.  If the stash overflows, the next geometry is tried.
+static int resize(struct fp128set *set, uint64_t lo, uint64_t hi)
+{
+    int logsize = set->logsize;
+    int bsize = set->bsize;
+    while (1) {
+	if (bsize < 4)
+	    bsize++;
+	else
+	    logsize++, bsize = 3;
+	if (logsize > 32)
+	    return set->cnt--, errno = E2BIG, -1;
+	int rc = bsize == 3 ? t_rebuild(set, lo, hi, logsize, 3)
+			    : t_rebuild(set, lo, hi, logsize, 4);
+	if (rc > 0)
+	    return 2;
+	if (rc < 0)
+	    return set->cnt--, -1;
+    }
+}
+
+// The slow path, after the random walk has failed.
+__attribute__((noinline))
+static int insertTail(struct fp128set *set, uint64_t lo, uint64_t hi)
+{
+    bool ok;
+    if (set->bsize == 2)
+	ok = t_stash(set, lo, hi, 2);
+    else if (set->bsize == 3)
+	ok = t_stash(set, lo, hi, 3);
+    else
+	ok = t_stash(set, lo, hi, 4);
+    if (ok)
+	return 1;
+    return resize(set, lo, hi);
+}
+
+// Template for virtual functions.
+static inline int t_add(struct fp128set *set, uint64_t lo, uint64_t hi,
+	bool nstash, int bsize)
+{
+    dFP2IB(lo, hi, set->bb, set->mask);
+    if (has(lo, hi, b1, b2, nstash, set->stash, bsize))
+	return 0;
+    // Strategically bump set->cnt.
+    set->cnt++;
+    if (justAdd2(lo, hi, b1, i1, b2, i2, bsize))
+	return 1;
+    if (kickAdd(lo, hi, set->bb, b1, i1, &lo, &hi, set->logsize, set->mask, bsize))
+	return 1;
+    return insertTail(set, lo, hi);
+}
+
+#undef MakeVFuncs
+#define MakeVFuncs(BS, ST) \
+    static int fp128set_add##BS##st##ST(uint64_t lo, uint64_t hi, struct fp128set *set) \
+    { return t_add(set, lo, hi, ST, BS); } \
+    static int fp128set_has##BS##st##ST(uint64_t lo, uint64_t hi, const struct fp128set *set) \
+    { return t_has(set, lo, hi, ST, BS); }
+MakeAllVFuncs
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,99 @@
+// Copyright (c) 2017, 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#ifndef __cplusplus
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#else
+#include <cstddef>
+#include <cstdint>
+extern "C" {
+#endif
+
+// A set of 128-bit fingerprints, the same cuckoo design as fp64set.
+// With n 64-bit fingerprints, the expected number of collisions is about
+// n^2/2^65, which gets real at a few billion; with 128 bits, it does not.
+// A fingerprint is passed as two 64-bit halves, lo and hi; each of the two
+// buckets is indexed by the low bits of either half.
+
+// Beta version, static linking only.
+#ifdef __GNUC__
+#pragma GCC visibility push(hidden)
+#endif
+
+// Create a new set; logsize is the expected number of elements, like in
+// fp64set_new().  Returns NULL on malloc failure.
+struct fp128set *fp128set_new(int logsize);
+void fp128set_free(struct fp128set *set);
+
+// The number of stash slots, 1..8.
+#ifndef FP128SET_STASH
+#define FP128SET_STASH 4
+#endif
+
+// Expose the structure, to inline vfunc calls.
+struct fp128set {
+    // The stashed fingerprints, lo and hi halves; the unused slots hold
+    // copies of the first one, as in fp64set.
+    uint64_t stash[2*FP128SET_STASH];
+    // Virtual functions, depend on the bucket size and the stash.
+    int (*add)(uint64_t lo, uint64_t hi, struct fp128set *set);
+    int (*has)(uint64_t lo, uint64_t hi, const struct fp128set *set);
+    // The buckets, bsize slots each, each slot being lo and hi.
+    uint64_t *bb;
+    // The number of fingerprints in the buckets, not including the stash.
+    size_t cnt;
+    // The number of buckets - 1, and its logarithm: 4..32.
+    uint32_t mask;
+    uint8_t logsize;
+    // The number of slots in each bucket: 2, 3, or 4.
+    uint8_t bsize;
+    // The number of fingerprints stashed: 0..FP128SET_STASH.
+    uint8_t nstash;
+};
+
+// Add a fingerprint to the set.  Returns 0 for a previously added one, 1
+// for a new one, 2 if the set has been resized; -1 on malloc failure.
+static inline int fp128set_add(struct fp128set *set, uint64_t lo, uint64_t hi)
+{
+    return set->add(lo, hi, set);
+}
+
+// Check if a fingerprint is in the set.
+static inline bool fp128set_has(const struct fp128set *set, uint64_t lo, uint64_t hi)
+{
+    return set->has(lo, hi, set);
+}
+
+// The number of fingerprints in the set.
+static inline size_t fp128set_size(const struct fp128set *set)
+{
+    return set->cnt + set->nstash;
+}
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,920 @@
+// Print the unique records of the input, in the order of their first
+// occurrence.  The records are lines (or fixed-length, with -r), hashed
+// into 64-bit fingerprints, so a false duplicate is possible, with the
+// probability of about n^2/2^65 for n unique records.  A regular file is
+// mmap'd, other input is read in chunks.  The records are hashed on the
+// worker threads, a chunk ahead, while the main thread feeds the set.
+// The unique records are written with writev(2): long records straight
+// from the input, short ones copied into a buffer.
+//
+// When fp64set_add() fails with EAGAIN, the set is rebuilt with another
+// seed, from the input processed so far (or, when the input cannot be
+// mapped, from the records already printed, which are spooled to a temporary
+// file), and the processing resumes at the failed record.
+//
+// With -M, when the set would take more than MEMLIMIT bytes, the records
+// are deduplicated in partitions spilled to the disk (see dedupExternal).
+//
+//	fp64dedup [-r RECLEN] [-j THREADS] [-n LOGSIZE] [-s SEED]
+//		  [-M MEMLIMIT] [-T TMPDIR] [-v] [FILE]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "fp64set.h"
+
+static inline uint64_t nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "fp64dedup: %s: %m\n", what);
+    exit(2);
+}
+
+#define K1 0x9e3779b97f4a7c15
+#define K2 0xc2b2ae3d27d4eb4f
+
+// The finalizer from MurmurHash3: both halves of the fingerprint,
+// which serve as the two cuckoo hashes, depend on all the bits.
+static inline uint64_t fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53;
+    h ^= h >> 33;
+    return h;
+}
+
+// The options.
+static size_t reclen;	// 0 for lines
+static int nthreads;	// 0 to hash on the main thread
+static bool verbose;
+
+// The end of the last record which starts before p + want, i.e. where the
+// next chunk (or segment) begins; the whole buffer when there is no such
+// boundary.  At least one record is taken, if the buffer is not empty.
+static size_t recEnd(const char *p, size_t len, size_t want)
+{
+    if (want >= len)
+	return len;
+    if (reclen) {
+	size_t n = want - want % reclen;
+	return n ? n : reclen < len ? reclen : len;
+    }
+    const char *nl = memchr(p + want, '\n', len - want);
+    return nl ? (size_t) (nl + 1 - p) : len;
+}
+
+// A record, at p + off in its segment; len includes the newline.
+struct rec {
+    uint64_t fp;
+    uint32_t off, len;
+};
+
+// A slice of the chunk hashed by one thread.
+struct seg {
+    const char *p;
+    size_t len;
+    uint64_t seed;
+    struct rec *rec;
+    size_t n, alloc;
+};
+
+// The length of the record at p, including the newline.
+static inline size_t recLen(const char *p, const char *end)
+{
+    if (reclen)
+	return (size_t) (end - p) < reclen ? (size_t) (end - p) : reclen;
+    const char *nl = memchr(p, '\n', end - p);
+    return nl ? nl + 1 - p : end - p;
+}
+
+static void *hashSeg(void *arg)
+{
+    struct seg *s = arg;
+    const char *p = s->p, *end = p + s->len;
+    s->n = 0;
+    while (p < end) {
+	size_t len = recLen(p, end);
+	if (len > UINT32_MAX) {
+	    errno = EFBIG;
+	    die("record too long");
+	}
+	if (s->n == s->alloc) {
+	    s->alloc = s->alloc ? 2 * s->alloc : 4096;
+	    s->rec = reallocarray(s->rec, s->alloc, sizeof *s->rec);
+	    if (!s->rec)
+		die("malloc");
+	}
+	// A missing newline at the end of the input does not matter.
+	size_t hlen = len - (!reclen && p[len-1] == '\n');
+	struct rec *r = &s->rec[s->n++];
+	r->fp = fp64set_hash(p, hlen, s->seed);
+	r->off = p - s->p;
+	r->len = len;
+	p += len;
+    }
+    return NULL;
+}
+
+#define MAXTHREADS 64
+
+// A chunk of the input, split into segments, one per thread.
+struct chunk {
+    const char *p;
+    size_t len;
+    uint64_t seed;
+    int nseg;
+    struct seg seg[MAXTHREADS];
+    pthread_t tid[MAXTHREADS];
+};
+
+// Start hashing the chunk.
+static void startChunk(struct chunk *c, const char *p, size_t len, uint64_t seed)
+{
+    c->p = p, c->len = len, c->seed = seed;
+    c->nseg = nthreads ? nthreads : 1;
+    size_t off = 0;
+    for (int i = 0; i < c->nseg; i++) {
+	struct seg *s = &c->seg[i];
+	size_t end = len;
+	if (i < c->nseg - 1) {
+	    end = recEnd(p, len, len / c->nseg * (i + 1));
+	    if (end < off)
+		end = off;
+	}
+	s->p = p + off, s->len = end - off, s->seed = seed;
+	off = end;
+	if (!nthreads)
+	    hashSeg(s);
+	else if ((errno = pthread_create(&c->tid[i], NULL, hashSeg, s)))
+	    die("pthread_create");
+    }
+}
+
+static void joinChunk(struct chunk *c)
+{
+    for (int i = 0; nthreads && i < c->nseg; i++)
+	if ((errno = pthread_join(c->tid[i], NULL)))
+	    die("pthread_join");
+}
+
+// The chunks are this big, give or take a record; the reads are done
+// with this buffer size, which grows to fit a longer line.
+#define CHUNK (8 << 20)
+
+static struct fp64set *set;
+static uint64_t seed = K2;
+static size_t nbytes, nrec, nuniq, reseeds;
+
+// The output: the iovecs point either into the input, or into obuf.
+#define OBUF (1 << 20)
+#define NIOV 1024
+#define SHORTREC 512
+static char obuf[OBUF];
+static size_t olen;
+static struct iovec iov[NIOV];
+static int niov;
+
+// When the input is not mapped, the printed records are also written here.
+static int spoolFd = -1;
+static size_t spoolSize;
+
+static void writeAll(int fd, struct iovec *v, int n)
+{
+    while (n) {
+	ssize_t w = writev(fd, v, n);
+	if (w < 0) {
+	    if (errno == EINTR)
+		continue;
+	    die(fd == 1 ? "write" : "spool");
+	}
+	for (; n && (size_t) w >= v->iov_len; v++, n--)
+	    w -= v->iov_len;
+	if (n)
+	    v->iov_base = (char *) v->iov_base + w, v->iov_len -= w;
+    }
+}
+
+static void flushOut(void)
+{
+    if (spoolFd >= 0) {
+	// The iovecs are consumed by writeAll(), hence a copy.
+	struct iovec v[NIOV];
+	memcpy(v, iov, niov * sizeof *iov);
+	writeAll(spoolFd, v, niov);
+	for (int i = 0; i < niov; i++)
+	    spoolSize += iov[i].iov_len;
+    }
+    writeAll(1, iov, niov);
+    niov = 0, olen = 0;
+}
+
+static void emit(const char *p, size_t len)
+{
+    bool copy = len < SHORTREC;
+    if (niov == NIOV || (copy && olen + len > OBUF))
+	flushOut();
+    if (copy) {
+	memcpy(obuf + olen, p, len);
+	p = obuf + olen;
+	olen += len;
+    }
+    if (niov && (char *) iov[niov-1].iov_base + iov[niov-1].iov_len == p)
+	iov[niov-1].iov_len += len;
+    else {
+	iov[niov].iov_base = (void *) p;
+	iov[niov].iov_len = len;
+	niov++;
+    }
+}
+
+// Add the records to the set, and print the new ones (unless rebuilding).
+// Returns the record at which fp64set_add() failed with EAGAIN, or NULL.
+static const char *addChunk(struct chunk *c, bool print)
+{
+    for (int i = 0; i < c->nseg; i++) {
+	const struct seg *s = &c->seg[i];
+	for (size_t j = 0; j < s->n; j++) {
+	    const struct rec *r = &s->rec[j];
+	    // The buckets are likely out of cache, load them in advance.
+	    if (j + 16 < s->n) {
+		uint64_t fp = r[16].fp;
+		__builtin_prefetch(set->bb + set->bsize * (fp & set->mask));
+		__builtin_prefetch(set->bb + set->bsize * (fp >> 32 & set->mask));
+	    }
+	    int rc = fp64set_add(set, r->fp);
+	    if (rc < 0) {
+		if (errno != EAGAIN)
+		    die("fp64set_add");
+		return s->p + r->off;
+	    }
+	    if (!print)
+		continue;
+	    nrec++;
+	    if (rc == 0)
+		continue;
+	    nuniq++;
+	    const char *p = s->p + r->off;
+	    emit(p, r->len);
+	    if (!reclen && p[r->len-1] != '\n')
+		emit("\n", 1);
+	}
+    }
+    return NULL;
+}
+
+// Start over with another seed, adding the records in p[0..len).
+static void rebuild(const char *p, size_t len, struct chunk *c)
+{
+    int logsize = set->logsize;
+again:
+    fp64set_free(set);
+    set = fp64set_new(logsize);
+    if (!set)
+	die("fp64set_new");
+    seed += K1;
+    reseeds++;
+    if (verbose)
+	fprintf(stderr, "fp64dedup: fp64set_add failed, rebuilding with seed %016" PRIx64 "\n", seed);
+    for (size_t off = 0; off < len; ) {
+	size_t n = recEnd(p + off, len - off, CHUNK);
+	startChunk(c, p + off, n, seed);
+	joinChunk(c);
+	if (addChunk(c, false))
+	    goto again;
+	off += n;
+    }
+}
+
+// The chunks of the input, one is being added while the next is hashed.
+static struct chunk chunks[3];
+
+// Add the chunk which has been hashed, and recover from failures; base
+// is the start of the mapped input, or NULL.
+static void processChunk(struct chunk *c, const char *base)
+{
+    struct chunk *tmp = &chunks[2];
+    const char *fail;
+    while ((fail = addChunk(c, true))) {
+	flushOut();
+	if (base)
+	    rebuild(base, fail - base, tmp);
+	else if (spoolSize) {
+	    void *m = mmap(NULL, spoolSize, PROT_READ, MAP_PRIVATE, spoolFd, 0);
+	    if (m == MAP_FAILED)
+		die("mmap spool");
+	    rebuild(m, spoolSize, tmp);
+	    munmap(m, spoolSize);
+	}
+	else
+	    rebuild(NULL, 0, tmp);
+	// The rest of the chunk, with the new seed.
+	startChunk(c, fail, c->p + c->len - fail, seed);
+	joinChunk(c);
+    }
+}
+
+// Hash the mapped input chunk by chunk, and pass the chunks to fn.
+static void forChunks(const char *p, size_t len, void (*fn)(struct chunk *c, const char *base))
+{
+    struct chunk *cur = &chunks[0], *next = &chunks[1];
+    size_t n = recEnd(p, len, CHUNK);
+    startChunk(cur, p, n, seed);
+    joinChunk(cur);
+    for (size_t off = n; cur->len; off += n) {
+	n = recEnd(p + off, len - off, CHUNK);
+	startChunk(next, p + off, n, seed);
+	fn(cur, p);
+	joinChunk(next);
+	// Hashed with the old seed, while the set was rebuilt.
+	if (next->seed != seed) {
+	    startChunk(next, next->p, next->len, seed);
+	    joinChunk(next);
+	}
+	flushOut();
+	struct chunk *t = cur; cur = next; next = t;
+    }
+}
+
+// A read buffer; the chunk is followed by the beginning of the next one.
+struct rbuf {
+    char *buf;
+    size_t size, len;
+};
+
+// Read the next chunk into b, after the rest of the previous buffer;
+// returns the length of the chunk, 0 at the end of input.
+static size_t readChunk(int fd, struct rbuf *b, struct rbuf *prev, size_t chunkLen)
+{
+    size_t carry = prev->len - chunkLen;
+    if (b->size < carry + CHUNK) {
+	b->size = carry + CHUNK;
+	free(b->buf);
+	if (!(b->buf = malloc(b->size)))
+	    die("malloc");
+    }
+    memcpy(b->buf, prev->buf + chunkLen, carry);
+    b->len = carry;
+    prev->len = chunkLen;
+    while (1) {
+	while (b->len < b->size) {
+	    ssize_t r = read(fd, b->buf + b->len, b->size - b->len);
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    if (r < 0)
+		die("read");
+	    if (r == 0)
+		return b->len;
+	    b->len += r;
+	    nbytes += r;
+	}
+	// The buffer is full, the chunk ends with the last complete record.
+	if (reclen && b->len >= reclen)
+	    return b->len - b->len % reclen;
+	if (!reclen) {
+	    const char *nl = memrchr(b->buf, '\n', b->len);
+	    if (nl)
+		return nl + 1 - b->buf;
+	}
+	// No complete record yet.
+	b->size *= 2;
+	if (!(b->buf = realloc(b->buf, b->size)))
+	    die("malloc");
+    }
+}
+
+static void dedupStream(int fd)
+{
+    FILE *spool = tmpfile();
+    if (!spool)
+	die("tmpfile");
+    spoolFd = fileno(spool);
+    struct rbuf rb[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+    struct chunk *cur = &chunks[0], *next = &chunks[1];
+    size_t n = readChunk(fd, &rb[0], &rb[1], 0);
+    startChunk(cur, rb[0].buf, n, seed);
+    joinChunk(cur);
+    for (int k = 1; cur->len; k ^= 1) {
+	n = readChunk(fd, &rb[k], &rb[k^1], n);
+	startChunk(next, rb[k].buf, n, seed);
+	processChunk(cur, NULL);
+	joinChunk(next);
+	if (next->seed != seed) {
+	    startChunk(next, next->p, next->len, seed);
+	    joinChunk(next);
+	}
+	// Done with cur's buffer, which will be read into.
+	flushOut();
+	struct chunk *t = cur; cur = next; next = t;
+    }
+    free(rb[0].buf);
+    free(rb[1].buf);
+    fclose(spool);
+}
+
+// External mode, when the set would not fit in memory (-M).  The first
+// pass writes (fingerprint, record number) pairs into spill files, by the
+// high bits of the fingerprint.  Each partition is then deduplicated with
+// a set of its own, marking the unique records in a bitmap (a partition
+// which is still too big is split further by the next 4 bits).  The last
+// pass prints the marked records, in the input order.  Besides the sets,
+// the memory goes to the bitmap (1 bit per record) and the spill buffers.
+static size_t memlimit;
+static const char *tmpdir;
+static size_t nparts, nsplits, spilled;
+
+// The set takes up to 16 bytes per fingerprint.
+#define SETBYTES 16
+
+static int tempFd(void)
+{
+    char fname[PATH_MAX];
+    snprintf(fname, sizeof fname, "%s/fp64dedup.XXXXXX", tmpdir);
+    int fd = mkstemp(fname);
+    if (fd < 0)
+	die(fname);
+    unlink(fname);
+    return fd;
+}
+
+// The spill files are written and read by a separate thread, so that
+// the disk and the CPU overlap: a buffer is handed over to the thread,
+// while the other one of the pair is being filled or consumed.
+struct io {
+    struct io *next;
+    int fd;
+    bool write, done;
+    char *buf;
+    size_t len;
+    off_t off;
+    ssize_t rc;
+};
+
+static pthread_mutex_t ioMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioCond = PTHREAD_COND_INITIALIZER;
+static struct io *ioHead, **ioTail = &ioHead;
+
+static void *ioLoop(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&ioMutex);
+    while (1) {
+	while (!ioHead)
+	    pthread_cond_wait(&ioCond, &ioMutex);
+	struct io *r = ioHead;
+	if (!(ioHead = r->next))
+	    ioTail = &ioHead;
+	pthread_mutex_unlock(&ioMutex);
+	size_t len = 0;
+	ssize_t n = 0;
+	while (len < r->len) {
+	    n = r->write ?
+		pwrite(r->fd, r->buf + len, r->len - len, r->off + len) :
+		pread(r->fd, r->buf + len, r->len - len, r->off + len);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n <= 0)
+		break;
+	    len += n;
+	}
+	pthread_mutex_lock(&ioMutex);
+	r->rc = n < 0 ? -errno : (ssize_t) len;
+	r->done = true;
+	pthread_cond_broadcast(&ioCond);
+    }
+    return NULL;
+}
+
+static void ioSubmit(struct io *r)
+{
+    r->next = NULL;
+    r->done = false;
+    pthread_mutex_lock(&ioMutex);
+    *ioTail = r;
+    ioTail = &r->next;
+    pthread_cond_broadcast(&ioCond);
+    pthread_mutex_unlock(&ioMutex);
+}
+
+static size_t ioWait(struct io *r)
+{
+    pthread_mutex_lock(&ioMutex);
+    while (!r->done)
+	pthread_cond_wait(&ioCond, &ioMutex);
+    pthread_mutex_unlock(&ioMutex);
+    if (r->rc < 0 || (r->write && (size_t) r->rc < r->len)) {
+	errno = r->rc < 0 ? -r->rc : ENOSPC;
+	die(r->write ? "spill write" : "spill read");
+    }
+    return r->rc;
+}
+
+// A partition being written, in pairs of (fp, recno).
+#define PBUF (64 << 10)
+
+struct part {
+    int fd;
+    size_t size;
+    struct io io[2];
+    int cur;
+    size_t n;
+};
+
+static void partOpen(struct part *pt)
+{
+    pt->fd = tempFd();
+    pt->size = 0;
+    pt->cur = 0;
+    pt->n = 0;
+    for (int i = 0; i < 2; i++) {
+	pt->io[i].done = true;
+	pt->io[i].rc = 0;
+	pt->io[i].len = 0;
+	pt->io[i].write = true;
+	if (!(pt->io[i].buf = malloc(PBUF)))
+	    die("malloc");
+    }
+}
+
+static void partFlush(struct part *pt)
+{
+    if (pt->n == 0)
+	return;
+    struct io *r = &pt->io[pt->cur];
+    r->fd = pt->fd;
+    r->len = 16 * pt->n;
+    r->off = pt->size;
+    pt->size += r->len;
+    spilled += r->len;
+    ioSubmit(r);
+    // The other buffer is reused once it has been written out.
+    pt->cur ^= 1;
+    pt->n = 0;
+    ioWait(&pt->io[pt->cur]);
+}
+
+static inline void partPut(struct part *pt, uint64_t fp, uint64_t recno)
+{
+    uint64_t *e = (uint64_t *) pt->io[pt->cur].buf + 2 * pt->n;
+    e[0] = fp, e[1] = recno;
+    if (++pt->n == PBUF / 16)
+	partFlush(pt);
+}
+
+// Flush the partition, it can then be read back.
+static void partClose(struct part *pt)
+{
+    partFlush(pt);
+    for (int i = 0; i < 2; i++) {
+	ioWait(&pt->io[i]);
+	free(pt->io[i].buf);
+    }
+}
+
+// Read the partition back in blocks, with the next block read ahead,
+// and pass the pairs to fn, until it returns false.
+#define RBUF (1 << 20)
+
+static void partScan(int fd, size_t size,
+	bool (*fn)(const uint64_t *e, size_t n, void *arg), void *arg)
+{
+    static char *buf[2];
+    struct io io[2];
+    for (int i = 0; i < 2; i++) {
+	if (!buf[i] && !(buf[i] = malloc(RBUF)))
+	    die("malloc");
+	io[i].fd = fd;
+	io[i].write = false;
+	io[i].buf = buf[i];
+    }
+    size_t off = 0;
+    int k = 0;
+    io[0].off = 0, io[0].len = size < RBUF ? size : RBUF;
+    if (size)
+	ioSubmit(&io[0]);
+    while (off < size) {
+	size_t n = ioWait(&io[k]);
+	if (n != io[k].len) {
+	    errno = EIO;
+	    die("spill read");
+	}
+	off += n;
+	bool more = off < size;
+	if (more) {
+	    io[k^1].off = off;
+	    io[k^1].len = size - off < RBUF ? size - off : RBUF;
+	    ioSubmit(&io[k^1]);
+	}
+	if (!fn((const uint64_t *) io[k].buf, n / 16, arg)) {
+	    if (more)
+		ioWait(&io[k^1]);
+	    return;
+	}
+	k ^= 1;
+    }
+}
+
+// The records which are printed.
+static uint64_t *marked;
+
+// The partitions have the high bits of the fingerprint in common, while
+// the set takes the low and the high 32 bits for the bucket indexes; the
+// bits are remixed, which is a bijection, with the salt changed on EAGAIN.
+struct addCtx {
+    struct fp64set *set;
+    uint64_t salt;
+    int err;
+};
+
+static bool addPairs(const uint64_t *e, size_t n, void *arg)
+{
+    struct addCtx *ctx = arg;
+    struct fp64set *set = ctx->set;
+    for (size_t i = 0; i < n; i++, e += 2) {
+	if (i + 16 < n) {
+	    uint64_t fp = fmix64(e[32] ^ ctx->salt);
+	    __builtin_prefetch(set->bb + set->bsize * (fp & set->mask));
+	    __builtin_prefetch(set->bb + set->bsize * (fp >> 32 & set->mask));
+	}
+	int rc = fp64set_add(set, fmix64(e[0] ^ ctx->salt));
+	if (rc < 0) {
+	    ctx->err = errno;
+	    return false;
+	}
+	// On a retry, the same records get marked again.
+	if (rc > 0)
+	    marked[e[1] / 64] |= (uint64_t) 1 << e[1] % 64;
+    }
+    return true;
+}
+
+struct splitCtx {
+    struct part *sub;
+    int shift;
+};
+
+static bool splitPairs(const uint64_t *e, size_t n, void *arg)
+{
+    struct splitCtx *ctx = arg;
+    for (size_t i = 0; i < n; i++, e += 2)
+	partPut(&ctx->sub[e[0] >> ctx->shift & 15], e[0], e[1]);
+    return true;
+}
+
+// Dedup the partition, whose fingerprints have the high bits in common,
+// and close it.
+static void dedupPart(int fd, size_t n, int bits)
+{
+    // The sets smaller than the spill buffers are not worth splitting.
+    bool canSplit = bits + 4 <= 32 && n * 16 > 32 * PBUF;
+    if (n * SETBYTES <= memlimit || !canSplit) {
+	int logsize = 4;
+	while (logsize < 32 && ((size_t) 1 << logsize) < n)
+	    logsize++;
+	struct addCtx ctx = { NULL, 0, 0 };
+	while (1) {
+	    ctx.set = fp64set_new(logsize);
+	    if (!ctx.set)
+		ctx.err = errno;
+	    else {
+		ctx.err = 0;
+		partScan(fd, 16 * n, addPairs, &ctx);
+		fp64set_free(ctx.set);
+	    }
+	    if (ctx.err != EAGAIN)
+		break;
+	    ctx.salt += K1;
+	    reseeds++;
+	}
+	if (ctx.err == 0) {
+	    close(fd);
+	    return;
+	}
+	if (ctx.err != ENOMEM || !canSplit) {
+	    errno = ctx.err;
+	    die("fp64set_add");
+	}
+    }
+    // Does not fit, split by the next 4 bits.
+    struct part sub[16];
+    for (int i = 0; i < 16; i++)
+	partOpen(&sub[i]);
+    struct splitCtx ctx = { sub, 64 - bits - 4 };
+    partScan(fd, 16 * n, splitPairs, &ctx);
+    close(fd);
+    nsplits++;
+    for (int i = 0; i < 16; i++)
+	partClose(&sub[i]);
+    for (int i = 0; i < 16; i++)
+	dedupPart(sub[i].fd, sub[i].size / 16, bits + 4);
+}
+
+static struct part *parts;
+static int pbits;
+
+static void spillChunk(struct chunk *c, const char *base)
+{
+    (void) base;
+    for (int i = 0; i < c->nseg; i++) {
+	const struct seg *s = &c->seg[i];
+	for (size_t j = 0; j < s->n; j++)
+	    partPut(&parts[s->rec[j].fp >> (64 - pbits)], s->rec[j].fp, nrec++);
+    }
+}
+
+static void dedupExternal(const char *p, size_t len, size_t nguess)
+{
+    pthread_t tid;
+    if ((errno = pthread_create(&tid, NULL, ioLoop, NULL)))
+	die("pthread_create");
+    // Up to 256 partitions, the rest is done by splitting.
+    size_t need = nguess * SETBYTES / memlimit + 1;
+    for (pbits = 1; pbits < 8 && ((size_t) 1 << pbits) < need; pbits++)
+	;
+    nparts = (size_t) 1 << pbits;
+    parts = calloc(nparts, sizeof *parts);
+    if (!parts)
+	die("malloc");
+    for (size_t i = 0; i < nparts; i++)
+	partOpen(&parts[i]);
+    forChunks(p, len, spillChunk);
+    for (size_t i = 0; i < nparts; i++)
+	partClose(&parts[i]);
+    marked = calloc(nrec / 64 + 1, sizeof *marked);
+    if (!marked)
+	die("malloc");
+    for (size_t i = 0; i < nparts; i++)
+	dedupPart(parts[i].fd, parts[i].size / 16, pbits);
+    // Print the marked records.
+    const char *end = p + len;
+    for (size_t k = 0; p < end; k++) {
+	size_t n = recLen(p, end);
+	if (marked[k / 64] >> k % 64 & 1) {
+	    nuniq++;
+	    emit(p, n);
+	    if (!reclen && p[n-1] != '\n')
+		emit("\n", 1);
+	}
+	p += n;
+    }
+    flushOut();
+    free(marked);
+    free(parts);
+}
+
+// With -M, the input which cannot be mapped is copied to a temporary file.
+static int spoolInput(int fd)
+{
+    int tfd = tempFd();
+    static char buf[RBUF];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) != 0) {
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    die("read");
+	for (ssize_t w, off = 0; off < n; off += w)
+	    if ((w = write(tfd, buf + off, n - off)) < 0)
+		die("spool");
+    }
+    return tfd;
+}
+
+// Guess the number of records, from the average length in the first 1M.
+static size_t guessRecords(const char *p, size_t len)
+{
+    if (reclen)
+	return len / reclen + 1;
+    size_t n = len < RBUF ? len : RBUF;
+    size_t nl = 1;
+    for (const char *q = p; (q = memchr(q, '\n', p + n - q)); q++)
+	nl++;
+    return len / (n / nl + 1) + 1;
+}
+
+static size_t parseSize(const char *s)
+{
+    char *end;
+    size_t n = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; // fall through
+    case 'M': case 'm': n <<= 10; // fall through
+    case 'K': case 'k': n <<= 10;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int logsize = 0;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 1 ? ncpu - 1 : 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:j:n:s:M:T:v")) != -1) {
+	switch (opt) {
+	case 'r':
+	    reclen = strtoull(optarg, NULL, 0);
+	    if (reclen == 0 || reclen > UINT32_MAX)
+		goto usage;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 0 || nthreads > MAXTHREADS)
+		goto usage;
+	    break;
+	case 'n':
+	    logsize = atoi(optarg);
+	    if (logsize < 4 || logsize > 32)
+		goto usage;
+	    break;
+	case 's':
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'M':
+	    memlimit = parseSize(optarg);
+	    if (memlimit == 0)
+		goto usage;
+	    break;
+	case 'T':
+	    tmpdir = optarg;
+	    break;
+	case 'v':
+	    verbose = true;
+	    break;
+	default:
+	    goto usage;
+	}
+    }
+    if (optind + 1 < argc) {
+usage:	fprintf(stderr, "Usage: fp64dedup [-r RECLEN] [-j THREADS] [-n LOGSIZE] [-s SEED]\n"
+		"\t\t [-M MEMLIMIT] [-T TMPDIR] [-v] [FILE]\n");
+	return 2;
+    }
+    const char *fname = optind < argc ? argv[optind] : "-";
+    int fd = strcmp(fname, "-") ? open(fname, O_RDONLY) : 0;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+	die(fname);
+    if (!tmpdir && !(tmpdir = getenv("TMPDIR")))
+	tmpdir = "/tmp";
+    if (memlimit && !S_ISREG(st.st_mode)) {
+	fd = spoolInput(fd);
+	if (fstat(fd, &st) < 0)
+	    die("spool");
+    }
+    const char *map = NULL;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+	    map = NULL;
+	else
+	    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+    }
+    size_t nguess = map ? guessRecords(map, st.st_size) : 0;
+    bool external = map && memlimit && nguess * SETBYTES > memlimit;
+    if (logsize == 0)
+	for (logsize = 10; logsize < 28 && ((size_t) 1 << logsize) < nguess; logsize++)
+	    ;
+    if (external)
+	logsize = 4;
+    set = fp64set_new(logsize);
+    if (!set)
+	die("fp64set_new");
+    uint64_t t = nsec();
+    if (external)
+	dedupExternal(map, nbytes = st.st_size, nguess);
+    else if (map)
+	forChunks(map, nbytes = st.st_size, processChunk);
+    else
+	dedupStream(fd);
+    t = nsec() - t;
+    if (verbose)
+	fprintf(stderr, "fp64dedup: %zu records, %zu unique, %.3f s, "
+		"%.1f MB/s, %.1f Mrec/s, %zu reseeds\n", nrec, nuniq, t / 1e9,
+		nbytes * 1e3 / t, nrec * 1e3 / t, reseeds);
+    if (verbose && external)
+	fprintf(stderr, "fp64dedup: %zu partitions, %zu splits, %.1f MB spilled\n",
+		nparts, nsplits, spilled / 1e6);
+    fp64set_free(set);
+    return 0;
+}
@@ -23,8 +23,56 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "fp64set.h"
 
+#if FP64SET_STASH < 2 || FP64SET_STASH > 8 || FP64SET_STASH % 2
+#error "FP64SET_STASH must be 2, 4, 6, or 8"
+#endif
+
+// When both buckets are full, room for a new fingerprint is made either
+// by a random walk (the default), or by a breadth-first search for the
+// shortest eviction path (-DFP64SET_BFS=1), see bfsAdd() below.
+#ifndef FP64SET_BFS
+#define FP64SET_BFS 0
+#endif
+
+static inline uint64_t nsecClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+// Update the statistics, see fp64set_stats(); has() can update them
+// through a const set.
+#if FP64SET_STATS
+#define StatsAdd(set, field, n) \
+    FP64SET_STATS_ADD(((struct fp64set *) (set))->stats.field, n)
+#define dStatsClock(t) uint64_t t = nsecClock()
+#else
+#define StatsAdd(set, field, n) ((void) 0)
+#define dStatsClock(t) (void) 0
+#endif
+#define StatsKicks(set, nkick, ok)					\
+    ((ok) ? StatsAdd(set, kicks[nkick < FP64SET_STATS_KICKS ?		\
+				nkick : FP64SET_STATS_KICKS - 1], 1) :	\
+	    StatsAdd(set, kickfail, 1))
+#define StatsResize(set, k, t0, bytes)			\
+do {							\
+    StatsAdd(set, resize[k], 1);			\
+    StatsAdd(set, resizeNsec[k], nsecClock() - t0);	\
+    StatsAdd(set, resizeBytes[k], bytes);		\
+} while (0)
+
 // Make two indexes out of a fingerprint.
 // Fingerprints are treated as two 32-bit hash values for this purpose.
 #define Hash1(fp, mask) ((fp >> 00) & mask)
@@ -68,8 +116,10 @@ static inline int has(uint64_t fp, uint64_t *b1, uint64_t *b2,
     int has2 = fp == b2[0];
     // Stashed elements can be checked in the meantime.
     if (nstash) {
-	has1 |= fp == stash[0];
-	has2 |= fp == stash[1];
+	for (int j = 0; j < FP64SET_STASH; j += 2) {
+	    has1 |= fp == stash[j+0];
+	    has2 |= fp == stash[j+1];
+	}
     }
     // Check the rest of the slots.
     if (bsize > 1) {
@@ -87,6 +137,21 @@ static inline int has(uint64_t fp, uint64_t *b1, uint64_t *b2,
     return has1 | has2;
 }
 
+// The branchy version, for FP64SET_KERNEL_BRANCHY: returns as soon as
+// the fingerprint is found.  The stash is checked last, it rarely hits.
+static inline int hasBranchy(uint64_t fp, uint64_t *b1, uint64_t *b2,
+	bool nstash, const uint64_t *stash, int bsize)
+{
+    for (int j = 0; j < bsize; j++)
+	if (fp == b1[j] || fp == b2[j])
+	    return 1;
+    if (nstash)
+	for (int j = 0; j < FP64SET_STASH; j++)
+	    if (fp == stash[j])
+		return 1;
+    return 0;
+}
+
 // On 64-bit systems, assume malloc'd chunks are aligned to 16 bytes.
 // This should help to elicit aligned SSE2 instructions.
 // On i686, malloc aligns to 16 bytes since glibc-2.26~173.
@@ -98,16 +163,20 @@ static inline int has(uint64_t fp, uint64_t *b1, uint64_t *b2,
 #endif
 
 // Template for set->has virtual functions.
-static inline int t_has(const struct fp64set *set, uint64_t fp, bool nstash, int bsize)
+static inline int t_has(const struct fp64set *set, uint64_t fp, bool nstash, int bsize, bool br)
 {
     dFP2IB(fp, set->bb, set->mask);
+    if (br)
+	return hasBranchy(fp, b1, b2, nstash, set->stash, bsize);
     return has(fp, b1, b2, nstash, set->stash, bsize);
 }
 
 // Instantiate generic functions, only prototypes for now.
 #define MakeVFuncs(BS, ST) \
     static FP64SET_FASTCALL int fp64set_add##BS##st##ST(FP64SET_pFP64, struct fp64set *set); \
-    static FP64SET_FASTCALL int fp64set_has##BS##st##ST(FP64SET_pFP64, const struct fp64set *set);
+    static FP64SET_FASTCALL int fp64set_has##BS##st##ST(FP64SET_pFP64, const struct fp64set *set); \
+    static FP64SET_FASTCALL int fp64set_add##BS##st##ST##br(FP64SET_pFP64, struct fp64set *set); \
+    static FP64SET_FASTCALL int fp64set_has##BS##st##ST##br(FP64SET_pFP64, const struct fp64set *set);
 #define MakeAllVFuncs	\
     MakeVFuncs(2, 0)	\
     MakeVFuncs(2, 1)	\
@@ -131,18 +200,50 @@ do {							\
     HIDDEN FP64SET_FASTCALL int fp64set_add##BS##st##ST##sse4(FP64SET_pFP64, struct fp64set *set); \
     HIDDEN FP64SET_FASTCALL int fp64set_has##BS##st##ST##sse4(FP64SET_pFP64, const struct fp64set *set);
 MakeAllVFuncs
-#define SetVFuncs(set, BS, ST)				\
+#if FP64SET_BFS || FP64SET_STATS
+// The add() routines in assembly implement the random walk;
+// with BFS, or to count the kicks, only has() is taken from assembly.
+#define SetVFuncsSSE4(set, BS, ST)			\
 do {							\
-    if (__builtin_cpu_supports("sse4.1"))		\
-	SetVFuncsExt(set, BS, ST, sse4);		\
+    set->add = fp64set_add##BS##st##ST;			\
+    set->has = fp64set_has##BS##st##ST##sse4;		\
+} while (0)
+#else
+#define SetVFuncsSSE4(set, BS, ST)			\
+	SetVFuncsExt(set, BS, ST, sse4)
+#endif
+#define HAVE_SSE4 __builtin_cpu_supports("sse4.1")
+#define SetKernelVFuncs(set, BS, ST)			\
+do {							\
+    if (set->kernel == FP64SET_KERNEL_SSE4)		\
+	SetVFuncsSSE4(set, BS, ST);			\
+    else if (set->kernel == FP64SET_KERNEL_BRANCHY)	\
+	SetVFuncsExt(set, BS, ST, br);			\
     else						\
 	SetVFuncsExt(set, BS, ST, );			\
 } while (0)
 #else // non-x86
-#define SetVFuncs(set, BS, ST) \
-	SetVFuncsExt(set, BS, ST, )
+#define HAVE_SSE4 0
+#define SetKernelVFuncs(set, BS, ST)			\
+do {							\
+    if (set->kernel == FP64SET_KERNEL_BRANCHY)		\
+	SetVFuncsExt(set, BS, ST, br);			\
+    else						\
+	SetVFuncsExt(set, BS, ST, );			\
+} while (0)
 #endif
 
+// The prefilter, when enabled, intercepts the calls to the kernels;
+// the trace, when enabled, intercepts the calls on top of that.
+#define SetVFuncs(set, BS, ST)				\
+do {							\
+    SetKernelVFuncs(set, BS, ST);			\
+    if (set->filter)					\
+	filterWrap(set);				\
+    if (set->trace)					\
+	traceWrap(set);					\
+} while (0)
+
 // In case BS is not a literal.
 #define SelectVFuncs(set, BS, ST)			\
 do {							\
@@ -154,6 +255,37 @@ do {							\
 	SetVFuncs(set, 4, ST);				\
 } while (0)
 
+static FP64SET_FASTCALL int fp64set_addFilter(FP64SET_pFP64, struct fp64set *set);
+static FP64SET_FASTCALL int fp64set_hasFilter(FP64SET_pFP64, const struct fp64set *set);
+
+static inline void filterWrap(struct fp64set *set)
+{
+    set->fadd = set->add;
+    set->fhas = set->has;
+    set->add = fp64set_addFilter;
+    set->has = fp64set_hasFilter;
+}
+
+static FP64SET_FASTCALL int fp64set_addTrace(FP64SET_pFP64, struct fp64set *set);
+static FP64SET_FASTCALL int fp64set_hasTrace(FP64SET_pFP64, const struct fp64set *set);
+
+static inline void traceWrap(struct fp64set *set)
+{
+    set->tadd = set->add;
+    set->thas = set->has;
+    set->add = fp64set_addTrace;
+    set->has = fp64set_hasTrace;
+}
+
+// Reinstall the vfuncs after the kernel or the wrappers have changed.
+static void resetVFuncs(struct fp64set *set)
+{
+    if (set->nstash)
+	SelectVFuncs(set, set->bsize, 1);
+    else
+	SelectVFuncs(set, set->bsize, 0);
+}
+
 struct fp64set *fp64set_new(int logsize)
 {
     assert(logsize >= 0);
@@ -179,9 +311,16 @@ struct fp64set *fp64set_new(int logsize)
     if (!set)
 	return free(bb), NULL;
 
+    set->filter = NULL;
+    set->trace = NULL;
+    set->seed = 0;
+#if FP64SET_STATS
+    memset(&set->stats, 0, sizeof set->stats);
+#endif
+    set->kernel = HAVE_SSE4 ? FP64SET_KERNEL_SSE4 : FP64SET_KERNEL_C;
     SetVFuncs(set, 2, 0);
 
-    set->stash[0] = set->stash[1] = 0;
+    memset(set->stash, 0, sizeof set->stash);
     set->bb = bb;
     set->cnt = 0;
     set->mask = nb - 1;
@@ -208,6 +347,8 @@ static inline bool freeSlot(uint64_t fp, size_t i)
 #include <t1ha.h>
 #endif
 
+static int traceClose(struct fp64set_trace *t);
+
 void fp64set_free(struct fp64set *set)
 {
     if (!set)
@@ -239,6 +380,9 @@ void fp64set_free(struct fp64set *set)
     fprintf(stderr, "%s logsize=%d bsize=%d nstash=%d cnt=%zu hash=%016" PRIx64 "\n",
 	    __func__, set->logsize, set->bsize, set->nstash, cnt, hash);
 #endif
+    if (set->trace)
+	traceClose(set->trace);
+    free(set->filter);
     free(set->bb);
     free(set);
 }
@@ -300,9 +444,9 @@ static inline bool justAdd1(uint64_t fp, uint64_t *b, size_t i, int bsize)
 // When all slots for a fingerprint are occupied, insertion "kicks out"
 // an already existing fingerprint and tries to place it into the alternative
 // slot, thus triggering a series of evictions.  Returns false with the
-// kicked-out fingerprint in ofp.
+// kicked-out fingerprint in ofp.  The number of kicks goes to nkick.
 static inline bool kickAdd(uint64_t fp, uint64_t *bb, uint64_t *b, size_t i,
-	uint64_t *ofp, int logsize, size_t mask, int bsize)
+	uint64_t *ofp, int logsize, size_t mask, int bsize, int *nkick)
 {
     int maxkick = logsize << 1;
     do {
@@ -322,13 +466,118 @@ static inline bool kickAdd(uint64_t fp, uint64_t *bb, uint64_t *b, size_t i,
 	    i = i1;
 	b = bb + bsize * i;
 	// Insert to the alternative bucket.
-	if (justAdd1(fp, b, i, bsize))
+	if (justAdd1(fp, b, i, bsize)) {
+	    *nkick = (logsize << 1) - maxkick + 1;
 	    return true;
+	}
     } while (maxkick-- > 0);
     // Ran out of tries? ofp already set.
+    *nkick = (logsize << 1) + 1;
+    return false;
+}
+
+// The random walk makes up to 2*logsize kicks, each kick being a dependent
+// cache miss.  The alternative is to search the eviction graph breadth-first:
+// the buckets of each BFS level can be fetched in parallel, and the shortest
+// eviction path, once found, is applied in a single pass.  The graph is
+// a tree of buckets, rooted at the two buckets of the new fingerprint.
+struct bfsNode {
+    // The bucket index.
+    uint32_t i;
+    // The parent node, and the slot in the parent bucket whose
+    // fingerprint can be moved to this bucket.
+    uint16_t parent;
+    uint8_t slot;
+};
+
+// The maximum number of buckets visited: with bsize=4, a complete tree
+// has 3 levels (2+8+32) and a part of the 4th; with bsize=2, 6 levels.
+// Deeper searches find more paths, but each failed search gets costly.
+#define BFS_MAXNODE 128
+
+// Check if the bucket is on the path from the node to the root.
+// Buckets must not repeat on the eviction path, or else a fingerprint
+// could be moved into the slot which has already been vacated.
+static inline bool bfsOnPath(const struct bfsNode *q, size_t k, size_t i)
+{
+    while (1) {
+	if (q[k].i == i)
+	    return true;
+	if (k < 2)
+	    return false;
+	k = q[k].parent;
+    }
+}
+
+// Like kickAdd(), but the buckets are only modified once a free slot has
+// been found.  On failure, the table is intact, and fp is left homeless.
+static inline bool bfsAdd(uint64_t fp, uint64_t *bb, size_t i1, size_t i2,
+	size_t mask, int bsize, int *nkick)
+{
+    struct bfsNode q[BFS_MAXNODE];
+    q[0].i = i1, q[1].i = i2;
+    // Both buckets are known to be full.
+    size_t head = 0, tail = 2;
+    for (; head < tail; head++) {
+	size_t i = q[head].i;
+	uint64_t *b = bb + bsize * i;
+	if (head >= 2) {
+	    // Try to move the parent's fingerprint here.
+	    size_t p = q[head].parent;
+	    size_t s = q[head].slot;
+	    uint64_t *pb = bb + bsize * q[p].i;
+	    if (justAdd1(pb[s], b, i, bsize)) {
+		*nkick = 1;
+		// Shift the fingerprints along the path, towards the leaf.
+		while (p >= 2) {
+		    ++*nkick;
+		    size_t pp = q[p].parent;
+		    size_t ps = q[p].slot;
+		    uint64_t *ppb = bb + bsize * q[pp].i;
+		    pb[s] = ppb[ps];
+		    p = pp, s = ps, pb = ppb;
+		}
+		pb[s] = fp;
+		return true;
+	    }
+	}
+	// Enqueue the alternative buckets, issuing the prefetches,
+	// so that the whole next level is loaded in parallel.
+	for (int j = 0; j < bsize; j++) {
+	    if (tail == BFS_MAXNODE)
+		break;
+	    uint64_t ofp = b[j];
+	    size_t alt = Hash1(ofp, mask);
+	    if (alt == i)
+		alt = Hash2(ofp, mask);
+	    if (bfsOnPath(q, head, alt))
+		continue;
+	    __builtin_prefetch(bb + bsize * alt);
+	    q[tail].i = alt;
+	    q[tail].parent = head;
+	    q[tail].slot = j;
+	    tail++;
+	}
+    }
+    *nkick = 0;
     return false;
 }
 
+// Find room for a fingerprint when both of its buckets are full, by either
+// method.  Returns false with a homeless fingerprint in ofp.
+static inline bool evictAdd(uint64_t fp, uint64_t *bb, uint64_t *b1, size_t i1, size_t i2,
+	uint64_t *ofp, int logsize, size_t mask, int bsize, int *nkick)
+{
+#if FP64SET_BFS
+    (void) b1, (void) logsize;
+    *ofp = fp;
+    return bfsAdd(fp, bb, i1, i2, mask, bsize, nkick);
+#else
+    (void) i2;
+    return kickAdd(fp, bb, b1, i1, ofp, logsize, mask, bsize, nkick);
+#endif
+}
+
 static inline size_t insertloop(uint64_t *bb, size_t nswap, uint64_t *swap,
 	int logsize, size_t mask, int bsize)
 {
@@ -338,13 +587,27 @@ static inline size_t insertloop(uint64_t *bb, size_t nswap, uint64_t *swap,
 	dFP2IB(fp, bb, mask);
 	if (justAdd2(fp, b1, i1, b2, i2, bsize))
 	    continue;
-	if (kickAdd(fp, bb, b1, i1, &fp, logsize, mask, bsize))
+	int nkick;
+	if (evictAdd(fp, bb, b1, i1, i2, &fp, logsize, mask, bsize, &nkick))
 	    continue;
 	swap[nout++] = fp;
     }
     return nout;
 }
 
+// The first n elements of the stash are valid: pad the unused slots
+// with copies of stash[0], and switch vfuncs accordingly.
+static inline void restash(struct fp64set *set, size_t n, int bsize)
+{
+    for (size_t j = n; j < FP64SET_STASH; j++)
+	set->stash[j] = set->stash[0];
+    set->nstash = n;
+    if (n)
+	SelectVFuncs(set, bsize, 1);
+    else
+	SelectVFuncs(set, bsize, 0);
+}
+
 static inline uint64_t *reinterp23(uint64_t *bb, size_t nb)
 {
     // Resizing e.g. 2GB -> 3GB cannot trigger size_t overflow.
@@ -396,6 +659,7 @@ static inline uint64_t *reinterp34(uint64_t *bb, size_t nb, int logsize)
 
 static inline bool t_resize(struct fp64set *set, uint64_t fp, int bsize)
 {
+    dStatsClock(t0);
     uint64_t *bb = bsize == 2 ?
 	    reinterp23(set->bb, set->mask + 1) :
 	    reinterp34(set->bb, set->mask + 1, set->logsize);
@@ -416,31 +680,15 @@ static inline bool t_resize(struct fp64set *set, uint64_t fp, int bsize)
 	b[3] = fp;
 
     // Try to insert the stashed elements.
-    assert(set->nstash == 2);
-    set->nstash = insertloop(bb, 2, set->stash, set->logsize, set->mask, bsize + 1);
+    assert(set->nstash == FP64SET_STASH);
+    size_t nout = insertloop(bb, FP64SET_STASH, set->stash, set->logsize, set->mask, bsize + 1);
+    set->cnt += FP64SET_STASH - nout;
     // The outcome determines which vfuncs will further be used.
-    if (set->nstash == 0) {
-	if (bsize == 2)
-	    SetVFuncs(set, 3, 0);
-	else
-	    SetVFuncs(set, 4, 0);
-	// Both inserted.
-	set->cnt += 2;
-    }
-    else {
-	if (bsize == 2)
-	    SetVFuncs(set, 3, 1);
-	else
-	    SetVFuncs(set, 4, 1);
-	if (set->nstash == 1) {
-	    // One inserted.
-	    set->stash[1] = set->stash[0];
-	    set->cnt++;
-	}
-    }
+    restash(set, nout, bsize + 1);
 
     // The data structure upconverted.
     set->bsize = bsize + 1;
+    StatsResize(set, bsize - 2, t0, bsize * (set->mask + 1) * sizeof(uint64_t));
     return true;
 }
 
@@ -544,18 +792,19 @@ static bool fp64set_resize43(struct fp64set *set, uint64_t fp)
 {
     // The only point of deliberate failure:
     // bucket size = 4, fill factor < 50%.
+    dStatsClock(t0);
     size_t nb = set->mask + 1;
     if (set->cnt < 2 * nb)
 	return errno = EAGAIN, false;
 
-    uint64_t *swap = reallocarray(NULL, nb + 4, sizeof(uint64_t));
+    // Copy2 below may write one element past the end.
+    uint64_t *swap = reallocarray(NULL, nb + FP64SET_STASH + 2, sizeof(uint64_t));
     if (!swap)
 	return false;
-    size_t nswap = 3;
+    size_t nswap = FP64SET_STASH + 1;
     swap[0] = fp;
-    assert(set->nstash == 2);
-    swap[1] = set->stash[0];
-    swap[2] = set->stash[1];
+    assert(set->nstash == FP64SET_STASH);
+    memcpy(swap + 1, set->stash, sizeof set->stash);
 
     // Swap off the 4th tier, along with fp and the stashed elements.
     //
@@ -586,51 +835,47 @@ static bool fp64set_resize43(struct fp64set *set, uint64_t fp)
 
     size_t mask2 = 2 * nb - 1;
     nswap = insertloop(bb, nswap, swap, set->logsize + 1, mask2, 3);
-    if (nswap == 0) {
-	SetVFuncs(set, 3, 0);
-	set->cnt += 2;
-	set->nstash = 0;
-    }
-    else {
-	SetVFuncs(set, 3, 1);
-	set->stash[0] = swap[0];
-	if (nswap == 1) {
-	    set->cnt += 1;
-	    set->stash[1] = swap[0];
-	    set->nstash = 1;
-	}
-	else {
-	    assert(nswap == 2);
-	    set->stash[1] = swap[1];
-	    set->nstash = 2;
-	}
-    }
+    assert(nswap <= FP64SET_STASH);
+    memcpy(set->stash, swap, nswap * sizeof(uint64_t));
+    set->cnt += FP64SET_STASH - nswap;
+    restash(set, nswap, 3);
     free(swap);
 
     set->mask = mask2;
     set->logsize++;
     set->bsize = 3;
 
+    StatsResize(set, 2, t0, 4 * nb * sizeof(uint64_t));
     return true;
 }
 
+// Give the stashed elements another chance.  Since they were stashed,
+// other insertions have shuffled the buckets, and a new series of evictions
+// may well succeed.  This only happens on the slow path, after kickAdd()
+// has failed, and saves the stash from filling up and forcing a resize.
+static inline void unstash(struct fp64set *set, int bsize)
+{
+    size_t n = set->nstash;
+    size_t nout = insertloop(set->bb, n, set->stash, set->logsize, set->mask, bsize);
+    set->cnt += n - nout;
+    StatsAdd(set, unstashed, n - nout);
+    // The evictions may replace a stashed fingerprint with another one,
+    // so the padding must be redone even if none has found a home.
+    restash(set, nout, bsize);
+}
+
 static inline bool t_stash(struct fp64set *set, uint64_t fp, int bsize)
 {
     assert(set->bsize == bsize);
-    if (set->nstash == 0) {
+    if (set->nstash)
+	unstash(set, bsize);
+    if (set->nstash < FP64SET_STASH) {
 	set->cnt--;
-	set->nstash = 1;
-	set->stash[0] = set->stash[1] = fp;
-	SelectVFuncs(set, bsize, 1);
-	return true;
-    }
-    if (set->nstash == 1) {
-	set->cnt--;
-	set->nstash = 2;
-	set->stash[1] = fp;
+	StatsAdd(set, stashed, 1);
+	set->stash[set->nstash] = fp;
+	restash(set, set->nstash + 1, bsize);
 	return true;
     }
-    assert(set->nstash == 2);
     return false;
 }
 
@@ -673,17 +918,21 @@ HIDDEN FP64SET_FASTCALL int fp64set_insert4tail(FP64SET_pFP64, struct fp64set *s
 }
 
 // Template for virtual functions.
-static inline int t_add(struct fp64set *set, uint64_t fp, bool nstash, int bsize)
+static inline int t_add(struct fp64set *set, uint64_t fp, bool nstash, int bsize, bool br)
 {
     dFP2IB(fp, set->bb, set->mask);
-    if (has(fp, b1, b2, nstash, set->stash, bsize))
+    if (br ? hasBranchy(fp, b1, b2, nstash, set->stash, bsize)
+	   : has(fp, b1, b2, nstash, set->stash, bsize))
 	return 0;
     // Strategically bump set->cnt.
     set->cnt++;
     if (justAdd2(fp, b1, i1, b2, i2, bsize))
 	return 1;
     // A comment on random walk.
-    if (kickAdd(fp, set->bb, b1, i1, &fp, set->logsize, set->mask, bsize))
+    int nkick;
+    bool ok = evictAdd(fp, set->bb, b1, i1, i2, &fp, set->logsize, set->mask, bsize, &nkick);
+    StatsKicks(set, nkick, ok);
+    if (ok)
 	return 1;
     if (bsize == 2) return fp64set_insert2tail(FP64SET_aFP64(fp), set);
     if (bsize == 3) return fp64set_insert3tail(FP64SET_aFP64(fp), set);
@@ -694,9 +943,2074 @@ static inline int t_add(struct fp64set *set, uint64_t fp, bool nstash, int bsize
 #undef MakeVFuncs
 #define MakeVFuncs(BS, ST) \
     static FP64SET_FASTCALL int fp64set_add##BS##st##ST(FP64SET_pFP64, struct fp64set *set) \
-    { return t_add(set, LOHI2FP, ST, BS); } \
+    { return t_add(set, LOHI2FP, ST, BS, 0); } \
     static FP64SET_FASTCALL int fp64set_has##BS##st##ST(FP64SET_pFP64, const struct fp64set *set) \
-    { return t_has(set, LOHI2FP, ST, BS); }
+    { return t_has(set, LOHI2FP, ST, BS, 0); } \
+    static FP64SET_FASTCALL int fp64set_add##BS##st##ST##br(FP64SET_pFP64, struct fp64set *set) \
+    { return t_add(set, LOHI2FP, ST, BS, 1); } \
+    static FP64SET_FASTCALL int fp64set_has##BS##st##ST##br(FP64SET_pFP64, const struct fp64set *set) \
+    { return t_has(set, LOHI2FP, ST, BS, 1); }
 MakeAllVFuncs
 
+// The prefilter is an array of 64-bit words.  Each fingerprint sets 4 bits
+// in a single word, so a lookup takes a single probe.  The bits are taken
+// from the low 24 bits of the fingerprint, the word index from the bits
+// above.  With 8 bits per slot, the false positive rate is about 2%.
+static inline uint64_t filterBits(uint64_t fp)
+{
+    return (uint64_t) 1 << (fp >> 00 & 63) |
+	   (uint64_t) 1 << (fp >> 06 & 63) |
+	   (uint64_t) 1 << (fp >> 12 & 63) |
+	   (uint64_t) 1 << (fp >> 18 & 63);
+}
+
+#define FilterWord(fp, fmask) ((fp >> 24) & fmask)
+
+static inline bool filterHas(const struct fp64set *set, uint64_t fp)
+{
+    uint64_t bits = filterBits(fp);
+    return (set->filter[FilterWord(fp, set->fmask)] & bits) == bits;
+}
+
+static inline void filterAdd(struct fp64set *set, uint64_t fp)
+{
+    set->filter[FilterWord(fp, set->fmask)] |= filterBits(fp);
+}
+
+// (Re)build the filter from scratch, sized for the current number of slots.
+static bool filterBuild(struct fp64set *set, int fbits)
+{
+    size_t mask = set->mask;
+    size_t bsize = set->bsize;
+    size_t nbits = fbits * bsize * (mask + 1);
+    size_t nw = 1;
+    while (nw < nbits / 64)
+	nw <<= 1;
+    uint64_t *filter = calloc(nw, sizeof(uint64_t));
+    if (!filter)
+	return false;
+    free(set->filter);
+    set->filter = filter;
+    set->fmask = nw - 1;
+    set->fbits = fbits;
+    for (size_t i = 0; i <= mask; i++) {
+	const uint64_t *b = set->bb + bsize * i;
+	for (size_t j = 0; j < bsize; j++)
+	    if (!freeSlot(b[j], i))
+		filterAdd(set, b[j]);
+    }
+    for (size_t j = 0; j < set->nstash; j++)
+	filterAdd(set, set->stash[j]);
+    return true;
+}
+
+static FP64SET_FASTCALL int fp64set_hasFilter(FP64SET_pFP64, const struct fp64set *set)
+{
+    dFP;
+    if (!filterHas(set, fp))
+	return 0;
+    return set->fhas(FP64SET_aFP64(fp), set);
+}
+
+static FP64SET_FASTCALL int fp64set_addFilter(FP64SET_pFP64, struct fp64set *set)
+{
+    dFP;
+    int rc = set->fadd(FP64SET_aFP64(fp), set);
+    // After a resize, the filter has to grow.  If it cannot,
+    // the old one is still valid, only less selective.
+    if (rc == 1 || (rc == 2 && !filterBuild(set, set->fbits)))
+	filterAdd(set, fp);
+    return rc;
+}
+
+int fp64set_prefilter(struct fp64set *set, int bits)
+{
+    assert(bits >= 0);
+    if (bits == 0) {
+	free(set->filter);
+	set->filter = NULL;
+	resetVFuncs(set);
+	return 0;
+    }
+    bool wrap = !set->filter;
+    if (!filterBuild(set, bits))
+	return -1;
+    if (wrap)
+	resetVFuncs(set);
+    return 0;
+}
+
+// The trace is buffered, the records are written in big chunks.
+// Lookups may come from several threads at once, so the records
+// are appended under the lock.
+struct fp64set_trace {
+    FILE *f;
+    pthread_mutex_t mutex;
+    size_t n;
+    bool err;
+    unsigned char buf[FP64SET_TRACE_RECSIZE << 12];
+};
+
+static void traceFlush(struct fp64set_trace *t)
+{
+    if (fwrite(t->buf, 1, t->n, t->f) != t->n)
+	t->err = true;
+    t->n = 0;
+}
+
+static inline void traceRec(struct fp64set_trace *t, int op, int rc, uint64_t fp)
+{
+    pthread_mutex_lock(&t->mutex);
+    if (t->n >= sizeof t->buf)
+	traceFlush(t);
+    unsigned char *p = t->buf + t->n;
+    p[0] = op | (rc + 1) << 4;
+    memcpy(p + 1, &fp, sizeof fp);
+    t->n += FP64SET_TRACE_RECSIZE;
+    pthread_mutex_unlock(&t->mutex);
+}
+
+static int traceClose(struct fp64set_trace *t)
+{
+    traceFlush(t);
+    bool err = t->err | (fclose(t->f) != 0);
+    pthread_mutex_destroy(&t->mutex);
+    free(t);
+    return err ? -1 : 0;
+}
+
+static FP64SET_FASTCALL int fp64set_hasTrace(FP64SET_pFP64, const struct fp64set *set)
+{
+    dFP;
+    int rc = set->thas(FP64SET_aFP64(fp), set);
+    // The kernels only guarantee that rc is nonzero.
+    traceRec(set->trace, FP64SET_TRACE_HAS, rc != 0, fp);
+    return rc;
+}
+
+static FP64SET_FASTCALL int fp64set_addTrace(FP64SET_pFP64, struct fp64set *set)
+{
+    dFP;
+    int rc = set->tadd(FP64SET_aFP64(fp), set);
+    traceRec(set->trace, FP64SET_TRACE_ADD, rc, fp);
+    return rc;
+}
+
+int fp64set_trace(struct fp64set *set, const char *fname)
+{
+    if (set->trace) {
+	int rc = traceClose(set->trace);
+	set->trace = NULL;
+	resetVFuncs(set);
+	if (!fname)
+	    return rc;
+    }
+    if (!fname)
+	return 0;
+    struct fp64set_trace *t = malloc(sizeof *t);
+    if (!t)
+	return -1;
+    t->f = fopen(fname, "wb");
+    if (!t->f)
+	return free(t), -1;
+    pthread_mutex_init(&t->mutex, NULL);
+    t->n = 0;
+    t->err = false;
+    struct fp64set_trace_header h = { "fp64trc1", set->logsize, FP64SET_STASH, { 0 } };
+    if (fwrite(&h, sizeof h, 1, t->f) != 1)
+	t->err = true;
+    // The fingerprints already in the set.
+    size_t mask = set->mask;
+    size_t bsize = set->bsize;
+    for (size_t i = 0; i <= mask; i++) {
+	const uint64_t *b = set->bb + bsize * i;
+	for (size_t j = 0; j < bsize; j++)
+	    if (!freeSlot(b[j], i))
+		traceRec(t, FP64SET_TRACE_LOAD, 1, b[j]);
+    }
+    for (size_t j = 0; j < set->nstash; j++)
+	traceRec(t, FP64SET_TRACE_LOAD, 1, set->stash[j]);
+    if (t->err) {
+	fclose(t->f);
+	pthread_mutex_destroy(&t->mutex);
+	free(t);
+	return errno = EIO, -1;
+    }
+    set->trace = t;
+    resetVFuncs(set);
+    return 0;
+}
+
+size_t fp64set_has_batch(const struct fp64set *set, const uint64_t *fpv, size_t n, bool *out)
+{
+    // Bypass the wrappers, the trace is taken care of below.
+    int (FP64SET_FASTCALL *has)(FP64SET_pFP64, const struct fp64set *set) =
+	    set->filter ? set->fhas : set->trace ? set->thas : set->has;
+    size_t mask = set->mask;
+    size_t bsize = set->bsize;
+    size_t hits = 0;
+    for (size_t k = 0; k < n; k += 16) {
+	size_t m = n - k < 16 ? n - k : 16;
+	const uint64_t *v = fpv + k;
+	bool *o = out + k;
+	// Only the buckets which pass the filter are fetched.
+	for (size_t j = 0; j < m; j++) {
+	    uint64_t fp = v[j];
+	    o[j] = !set->filter || filterHas(set, fp);
+	    if (o[j]) {
+		__builtin_prefetch(set->bb + bsize * Hash1(fp, mask));
+		__builtin_prefetch(set->bb + bsize * Hash2(fp, mask));
+	    }
+	}
+	for (size_t j = 0; j < m; j++)
+	    if (o[j])
+		hits += o[j] = has(FP64SET_aFP64(v[j]), set);
+	if (set->trace)
+	    for (size_t j = 0; j < m; j++)
+		traceRec(set->trace, FP64SET_TRACE_HAS, o[j], v[j]);
+    }
+    StatsAdd(set, has[0], n - hits);
+    StatsAdd(set, has[1], hits);
+    return hits;
+}
+
+// Hashing of byte keys: a word at a time, the tail being loaded with
+// overlapping reads, and the length mixed in upfront.  (This is the hash
+// from fp64dedup.c, which now calls fp64set_hash().)
+#define HASH_K1 UINT64_C(0x9e3779b97f4a7c15)
+#define HASH_K2 UINT64_C(0xc2b2ae3d27d4eb4f)
+
+static inline uint64_t hashRotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hashLoad64(const unsigned char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof x);
+    return x;
+}
+
+static inline uint32_t hashLoad32(const unsigned char *p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof x);
+    return x;
+}
+
+// The finalizer from MurmurHash3.
+static inline uint64_t hashMix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hashBytes(const unsigned char *p, size_t n, uint64_t seed)
+{
+    uint64_t h = seed ^ n * HASH_K1;
+    uint64_t w;
+    if (n >= 8) {
+	const unsigned char *last = p + n - 8;
+	for (; p < last; p += 8)
+	    h = hashRotl(h ^ hashLoad64(p) * HASH_K2, 31) * HASH_K1;
+	w = hashLoad64(last);
+    }
+    else if (n >= 4)
+	w = hashLoad32(p) | (uint64_t) hashLoad32(p + n - 4) << 32;
+    else if (n)
+	w = p[0] | p[n/2] << 8 | p[n-1] << 16;
+    else
+	w = 0;
+    h = hashRotl(h ^ w * HASH_K2, 31) * HASH_K1;
+    return hashMix(h);
+}
+
+uint64_t fp64set_hash(const void *key, size_t len, uint64_t seed)
+{
+    return hashBytes(key, len, seed);
+}
+
+// The keys are hashed in groups, the same size as in fp64set_has_batch().
+// There is no 64-bit vector multiply below AVX-512, so the hashes are not
+// vectorized; but the hash chains of a group are independent, and the
+// out-of-order core overlaps them, along with the prefetches.
+#define BYTES_BATCH 16
+
+static inline void hashGroup(const void *const *keys, const size_t *lens, size_t m,
+	uint64_t seed, uint64_t *fpv)
+{
+    for (size_t j = 0; j < m; j++)
+	fpv[j] = hashBytes(keys[j], lens[j], seed);
+}
+
+size_t fp64set_has_bytes_batch(const struct fp64set *set, const void *const *keys,
+	const size_t *lens, size_t n, bool *out)
+{
+    uint64_t fpv[BYTES_BATCH];
+    size_t hits = 0;
+    for (size_t k = 0; k < n; k += BYTES_BATCH) {
+	size_t m = n - k < BYTES_BATCH ? n - k : BYTES_BATCH;
+	hashGroup(keys + k, lens + k, m, set->seed, fpv);
+	hits += fp64set_has_batch(set, fpv, m, out + k);
+    }
+    return hits;
+}
+
+// Returns the number of keys processed, which is less than n on failure;
+// rc can be NULL.
+static size_t addBytes(struct fp64set *set, const void *const *keys,
+	const size_t *lens, size_t n, int *rc)
+{
+    uint64_t fpv[BYTES_BATCH];
+    for (size_t k = 0; k < n; k += BYTES_BATCH) {
+	size_t m = n - k < BYTES_BATCH ? n - k : BYTES_BATCH;
+	hashGroup(keys + k, lens + k, m, set->seed, fpv);
+	// The layout may change in the middle of the group,
+	// the prefetches are only a hint.
+	size_t mask = set->mask;
+	size_t bsize = set->bsize;
+	for (size_t j = 0; j < m; j++) {
+	    __builtin_prefetch(set->bb + bsize * Hash1(fpv[j], mask));
+	    __builtin_prefetch(set->bb + bsize * Hash2(fpv[j], mask));
+	}
+	for (size_t j = 0; j < m; j++) {
+	    int r = fp64set_add(set, fpv[j]);
+	    if (rc)
+		rc[k+j] = r;
+	    if (r < 0)
+		return k + j;
+	}
+    }
+    return n;
+}
+
+size_t fp64set_add_bytes_batch(struct fp64set *set, const void *const *keys,
+	const size_t *lens, size_t n, int *rc)
+{
+    size_t done = addBytes(set, keys, lens, n, rc);
+    return done < n ? done + 1 : n;
+}
+
+// Remove all the fingerprints.
+static void clearSet(struct fp64set *set)
+{
+    size_t bsize = set->bsize;
+    memset(set->bb, 0xff, bsize * sizeof(uint64_t));
+    memset(set->bb + bsize, 0, bsize * (size_t) set->mask * sizeof(uint64_t));
+    set->cnt = 0;
+    restash(set, 0, bsize);
+    if (set->filter)
+	memset(set->filter, 0, (set->fmask + 1) * sizeof(uint64_t));
+}
+
+// A failure with the next seed is as unlikely as the first one was,
+// so a few tries are plenty.
+#define RESEED_TRIES 8
+
+int fp64set_reseed(struct fp64set *set, const void *const *keys, const size_t *lens, size_t n)
+{
+    for (int t = 0; t < RESEED_TRIES; t++) {
+	clearSet(set);
+	set->seed += HASH_K1;
+	if (addBytes(set, keys, lens, n, NULL) == n)
+	    return 0;
+	if (errno != EAGAIN)
+	    return -1;
+    }
+    return errno = EAGAIN, -1;
+}
+
+void fp64set_foreach(const struct fp64set *set, void (*fn)(uint64_t fp, void *arg), void *arg)
+{
+    size_t mask = set->mask;
+    size_t bsize = set->bsize;
+    for (size_t i = 0; i <= mask; i++) {
+	const uint64_t *b = set->bb + bsize * i;
+	for (size_t j = 0; j < bsize; j++)
+	    if (!freeSlot(b[j], i))
+		fn(b[j], arg);
+    }
+    for (size_t j = 0; j < set->nstash; j++)
+	fn(set->stash[j], arg);
+}
+
+// The occupied slots form a prefix of the bucket (see justAdd2), so the
+// whole bucket is copied, with vector moves, and the output pointer is
+// advanced by the number of occupied slots, without branches.  Only near
+// the end of the output, where a whole bucket may not fit, the slots are
+// copied one by one.
+static inline size_t t_export(const struct fp64set *set, uint64_t *out, int bsize)
+{
+    size_t mask = set->mask;
+    uint64_t *o = out, *end = out + set->cnt;
+    for (int j = 0; j < bsize; j++)
+	if (!freeSlot(set->bb[j], 0))
+	    *o++ = set->bb[j];
+    size_t i = 1;
+    for (; i <= mask && end - o >= bsize; i++) {
+	const uint64_t *b = set->bb + bsize * i;
+	memcpy(o, b, bsize * sizeof(uint64_t));
+	size_t n = (b[0] != 0) + (b[1] != 0);
+	if (bsize > 2) n += b[2] != 0;
+	if (bsize > 3) n += b[3] != 0;
+	o += n;
+    }
+    for (; i <= mask && o < end; i++) {
+	const uint64_t *b = set->bb + bsize * i;
+	for (int j = 0; j < bsize; j++)
+	    if (b[j])
+		*o++ = b[j];
+    }
+    memcpy(o, set->stash, set->nstash * sizeof(uint64_t));
+    return o - out + set->nstash;
+}
+
+// LSD radix sort, 8 bits at a time, by the low nd digits, with tmp as the
+// second buffer.  The counts for all the passes are collected in a single
+// pass over the data, and the passes where all the numbers have the same
+// digit are skipped.  Returns the buffer with the result, v or tmp.
+static uint64_t *lsdSort(uint64_t *v, uint64_t *tmp, size_t n, int nd, size_t (*cnt)[256])
+{
+    if (n < 2)
+	return v;
+    memset(cnt, 0, nd * sizeof *cnt);
+    for (size_t i = 0; i < n; i++) {
+	uint64_t x = v[i];
+	for (int d = 0; d < nd; d++)
+	    cnt[d][x >> 8 * d & 255]++;
+    }
+    uint64_t *src = v, *dst = tmp;
+    for (int d = 0; d < nd; d++) {
+	size_t *c = cnt[d];
+	if (c[v[0] >> 8 * d & 255] == n)
+	    continue;
+	size_t sum = 0;
+	for (int k = 0; k < 256; k++) {
+	    size_t ck = c[k];
+	    c[k] = sum;
+	    sum += ck;
+	}
+	// The counts are not updated through dst.
+	uint64_t *restrict o = dst;
+	for (size_t i = 0; i < n; i++) {
+	    uint64_t x = src[i];
+	    o[c[x >> 8 * d & 255]++] = x;
+	}
+	uint64_t *t = src; src = dst; dst = t;
+    }
+    return src;
+}
+
+// Each LSD pass scatters the numbers all over the buffer; once the buffer
+// is well out of the cache, the numbers are first distributed by the high
+// digit (MSD), and the buckets are then sorted with LSD in the cache.
+#define LSD_MAX (1 << 16)
+
+static bool radixSort(uint64_t *v, size_t n)
+{
+    if (n < 2)
+	return true;
+    uint64_t *tmp = malloc(n * sizeof(uint64_t));
+    if (!tmp)
+	return false;
+    size_t (*cnt)[256] = malloc(8 * sizeof *cnt);
+    if (!cnt)
+	return free(tmp), false;
+    if (n <= LSD_MAX) {
+	uint64_t *r = lsdSort(v, tmp, n, 8, cnt);
+	if (r != v)
+	    memcpy(v, r, n * sizeof(uint64_t));
+    }
+    else {
+	size_t start[257] = { 0 };
+	for (size_t i = 0; i < n; i++)
+	    start[(v[i] >> 56) + 1]++;
+	for (int k = 0; k < 256; k++)
+	    start[k+1] += start[k];
+	size_t pos[256];
+	memcpy(pos, start, sizeof pos);
+	for (size_t i = 0; i < n; i++)
+	    tmp[pos[v[i] >> 56]++] = v[i];
+	for (int k = 0; k < 256; k++) {
+	    size_t lo = start[k], m = start[k+1] - lo;
+	    uint64_t *r = lsdSort(tmp + lo, v + lo, m, 7, cnt);
+	    if (r != v + lo)
+		memcpy(v + lo, r, m * sizeof(uint64_t));
+	}
+    }
+    free(cnt);
+    free(tmp);
+    return true;
+}
+
+size_t fp64set_export(const struct fp64set *set, uint64_t *out, bool sorted)
+{
+    size_t n;
+    switch (set->bsize) {
+    case 2: n = t_export(set, out, 2); break;
+    case 3: n = t_export(set, out, 3); break;
+    default: n = t_export(set, out, 4); break;
+    }
+    if (sorted && !radixSort(out, n))
+	return SIZE_MAX;
+    return n;
+}
+
+// Set algebra.  When both sets have the same number of buckets and the
+// same bucket size, a fingerprint of a in bucket i, if it is in b at all,
+// is either in bucket i of b or in the other one of its two buckets; with
+// the slots filled in the same order, it is in bucket i at least half of
+// the time.  So the buckets of a are compared against the buckets of b in
+// lockstep, sequentially, and only the fingerprints not found this way
+// are looked up in b, in groups, with the buckets prefetched.
+
+#define ALG_GROUP 8
+
+struct algebra {
+    struct fp64set *a;
+    const struct fp64set *b;
+    // Keep the fingerprints found in b (intersection), or not found.
+    bool want;
+    // In place, the others are removed from a; otherwise, the fingerprints
+    // kept are collected.
+    bool inplace;
+    int (FP64SET_FASTCALL *bhas)(FP64SET_pFP64, const struct fp64set *set);
+};
+
+// A range of a's buckets, processed by a thread.
+struct algJob {
+    const struct algebra *alg;
+    size_t lo, hi;
+    uint64_t *out;
+    size_t nout, alloc;
+    size_t removed;
+    bool nomem;
+};
+
+static inline bool algFound(const struct algebra *alg, uint64_t fp)
+{
+    const struct fp64set *b = alg->b;
+    return (!b->filter || filterHas(b, fp)) && alg->bhas(FP64SET_aFP64(fp), b);
+}
+
+static inline void algOut(struct algJob *job, uint64_t fp)
+{
+    if (job->nout == job->alloc) {
+	size_t alloc = job->alloc ? 2 * job->alloc : 1024;
+	uint64_t *out = realloc(job->out, alloc * sizeof(uint64_t));
+	if (!out) {
+	    job->nomem = true;
+	    return;
+	}
+	job->out = out, job->alloc = alloc;
+    }
+    job->out[job->nout++] = fp;
+}
+
+static void *algRange(void *arg)
+{
+    struct algJob *job = arg;
+    const struct algebra *alg = job->alg;
+    struct fp64set *a = alg->a;
+    const struct fp64set *b = alg->b;
+    size_t bsize = a->bsize;
+    bool lockstep = a->mask == b->mask && bsize == b->bsize;
+    size_t bmask = b->mask, bbsize = b->bsize;
+    uint64_t v[4 * ALG_GROUP];
+    bool found[4 * ALG_GROUP];
+    size_t cnt[ALG_GROUP];
+    for (size_t g = job->lo; g < job->hi; g += ALG_GROUP) {
+	size_t ng = job->hi - g < ALG_GROUP ? job->hi - g : ALG_GROUP;
+	size_t n = 0;
+	for (size_t k = 0; k < ng; k++) {
+	    size_t i = g + k;
+	    const uint64_t *ab = a->bb + bsize * i;
+	    size_t j = 0;
+	    for (; j < bsize && !freeSlot(ab[j], i); j++, n++) {
+		uint64_t fp = v[n] = ab[j];
+		bool f = false;
+		if (lockstep) {
+		    // Bucket i of b only exists with the same layout.
+		    const uint64_t *bb = b->bb + bsize * i;
+		    f = (fp == bb[0]) | (fp == bb[1]);
+		    if (bsize > 2) f |= fp == bb[2];
+		    if (bsize > 3) f |= fp == bb[3];
+		}
+		found[n] = f;
+	    }
+	    cnt[k] = j;
+	}
+	for (size_t k = 0; k < n; k++)
+	    if (!found[k]) {
+		__builtin_prefetch(b->bb + bbsize * Hash1(v[k], bmask));
+		__builtin_prefetch(b->bb + bbsize * Hash2(v[k], bmask));
+	    }
+	for (size_t k = 0; k < n; k++)
+	    if (!found[k])
+		found[k] = algFound(alg, v[k]);
+	if (!alg->inplace) {
+	    for (size_t k = 0; k < n; k++)
+		if (found[k] == alg->want)
+		    algOut(job, v[k]);
+	    continue;
+	}
+	// Compact the buckets, the slots kept go first.  The buckets
+	// which are left intact are not written to.
+	n = 0;
+	for (size_t k = 0; k < ng; k++) {
+	    size_t i = g + k;
+	    uint64_t *ab = a->bb + bsize * i;
+	    size_t m = 0;
+	    for (size_t j = 0; j < cnt[k]; j++, n++)
+		if (found[n] == alg->want) {
+		    if (m < j)
+			ab[m] = v[n];
+		    m++;
+		}
+	    job->removed += cnt[k] - m;
+	    for (; m < cnt[k]; m++)
+		ab[m] = 0 - (uint64_t) (i == 0);
+	}
+    }
+    return NULL;
+}
+
+// Run the jobs, splitting a's buckets into nthreads ranges.
+static bool algRun(const struct algebra *alg, struct algJob *jobs, int nthreads)
+{
+    size_t nb = (size_t) alg->a->mask + 1;
+    pthread_t tid[nthreads];
+    bool started[nthreads];
+    for (int t = 0; t < nthreads; t++) {
+	jobs[t] = (struct algJob) { alg, nb / nthreads * t,
+		t == nthreads - 1 ? nb : nb / nthreads * (t + 1), NULL, 0, 0, 0, false };
+	started[t] = t && pthread_create(&tid[t], NULL, algRange, &jobs[t]) == 0;
+    }
+    // The first range, and those for which a thread could not be started,
+    // are done by the calling thread.
+    for (int t = 0; t < nthreads; t++)
+	if (!started[t])
+	    algRange(&jobs[t]);
+    bool ok = true;
+    for (int t = 0; t < nthreads; t++) {
+	if (started[t])
+	    pthread_join(tid[t], NULL);
+	ok &= !jobs[t].nomem;
+    }
+    return ok;
+}
+
+// Add the fingerprints to dst, with the buckets prefetched.
+static int addAll(struct fp64set *dst, const uint64_t *v, size_t n)
+{
+    for (size_t k = 0; k < n; k += 16) {
+	size_t m = n - k < 16 ? n - k : 16;
+	size_t mask = dst->mask, bsize = dst->bsize;
+	for (size_t j = 0; j < m; j++) {
+	    __builtin_prefetch(dst->bb + bsize * Hash1(v[k+j], mask));
+	    __builtin_prefetch(dst->bb + bsize * Hash2(v[k+j], mask));
+	}
+	for (size_t j = 0; j < m; j++)
+	    if (fp64set_add(dst, v[k+j]) < 0)
+		return -1;
+    }
+    return 0;
+}
+
+static void unstashAny(struct fp64set *set)
+{
+    switch (set->bsize) {
+    case 2: unstash(set, 2); break;
+    case 3: unstash(set, 3); break;
+    default: unstash(set, 4); break;
+    }
+}
+
+// dst = a & b, or a - b (want = false).
+static int algFilter(struct fp64set *dst, const struct fp64set *a,
+	const struct fp64set *b, bool want, int nthreads)
+{
+    if (nthreads < 1)
+	nthreads = 1;
+    if ((size_t) nthreads > (size_t) a->mask + 1)
+	nthreads = a->mask + 1;
+    struct algebra alg = {
+	(struct fp64set *) a, b, want, dst == a,
+	b->filter ? b->fhas : b->trace ? b->thas : b->has,
+    };
+    struct algJob jobs[nthreads];
+    bool ok = algRun(&alg, jobs, nthreads);
+    int rc = ok ? 0 : (errno = ENOMEM, -1);
+    if (alg.inplace) {
+	size_t removed = 0;
+	for (int t = 0; t < nthreads; t++)
+	    removed += jobs[t].removed;
+	dst->cnt -= removed;
+	size_t m = 0;
+	for (size_t j = 0; j < dst->nstash; j++)
+	    if (algFound(&alg, dst->stash[j]) == want)
+		dst->stash[m++] = dst->stash[j];
+	if (m < dst->nstash) {
+	    removed += dst->nstash - m;
+	    restash(dst, m, dst->bsize);
+	}
+	// There may be room in the buckets now.
+	if (dst->nstash)
+	    unstashAny(dst);
+	// The filter has no deletions, rebuild it (or leave it stale,
+	// which only makes it less effective).
+	if (dst->filter && removed)
+	    filterBuild(dst, dst->fbits);
+    }
+    else {
+	for (int t = 0; t < nthreads; t++)
+	    if (rc == 0)
+		rc = addAll(dst, jobs[t].out, jobs[t].nout);
+	for (size_t j = 0; j < a->nstash && rc == 0; j++)
+	    if (algFound(&alg, a->stash[j]) == want)
+		rc = fp64set_add(dst, a->stash[j]) < 0 ? -1 : 0;
+    }
+    for (int t = 0; t < nthreads; t++)
+	free(jobs[t].out);
+    return rc;
+}
+
+// Add the fingerprints of src to dst (which is not src).
+static int addSet(struct fp64set *dst, const struct fp64set *src)
+{
+    size_t bsize = src->bsize;
+    uint64_t v[4 * ALG_GROUP];
+    for (size_t g = 0; g <= src->mask; g += ALG_GROUP) {
+	size_t ng = src->mask + 1 - g < ALG_GROUP ? src->mask + 1 - g : ALG_GROUP;
+	// The layout of dst changes as it grows.
+	bool lockstep = dst->mask == src->mask && dst->bsize == bsize;
+	size_t n = 0;
+	for (size_t i = g; i < g + ng; i++) {
+	    const uint64_t *sb = src->bb + bsize * i;
+	    for (size_t j = 0; j < bsize && !freeSlot(sb[j], i); j++) {
+		uint64_t fp = sb[j];
+		if (lockstep) {
+		    const uint64_t *db = dst->bb + bsize * i;
+		    bool f = (fp == db[0]) | (fp == db[1]);
+		    if (bsize > 2) f |= fp == db[2];
+		    if (bsize > 3) f |= fp == db[3];
+		    if (f)
+			continue;
+		}
+		v[n++] = fp;
+	    }
+	}
+	if (addAll(dst, v, n) < 0)
+	    return -1;
+    }
+    return addAll(dst, src->stash, src->nstash);
+}
+
+int fp64set_union(struct fp64set *dst, const struct fp64set *a, const struct fp64set *b)
+{
+    if (dst != a && dst != b && addSet(dst, a) < 0)
+	return -1;
+    if (a == b)
+	return 0;
+    return addSet(dst, dst == b ? a : b);
+}
+
+int fp64set_intersect_mt(struct fp64set *dst, const struct fp64set *a,
+	const struct fp64set *b, int nthreads)
+{
+    if (dst == b) {
+	const struct fp64set *t = a; a = b; b = t;
+    }
+    if (a == b)
+	return dst == a ? 0 : addSet(dst, a);
+    return algFilter(dst, a, b, true, nthreads);
+}
+
+int fp64set_difference_mt(struct fp64set *dst, const struct fp64set *a,
+	const struct fp64set *b, int nthreads)
+{
+    if (dst == b && dst != a)
+	return errno = EINVAL, -1;
+    if (a == b) {
+	if (dst == a)
+	    clearSet(dst);
+	return 0;
+    }
+    return algFilter(dst, a, b, false, nthreads);
+}
+
+int fp64set_intersect(struct fp64set *dst, const struct fp64set *a, const struct fp64set *b)
+{
+    return fp64set_intersect_mt(dst, a, b, 1);
+}
+
+int fp64set_difference(struct fp64set *dst, const struct fp64set *a, const struct fp64set *b)
+{
+    return fp64set_difference_mt(dst, a, b, 1);
+}
+
+// Merging sets.  The fingerprints of dst and the sources are exported into
+// a single array and partitioned by Hash1 into nthreads ranges of the new
+// buckets, each range being filled by one thread.  A thread only writes to
+// the buckets in its range: a fingerprint goes into its first bucket, or
+// its second one if it is in the range too, or else room is made by moving
+// another fingerprint to its alternative bucket, within the range.  Since
+// duplicates have the same Hash1, they meet in the same range.  The rest,
+// usually a few percent, are added with fp64set_add() in the end.
+#define MERGE_MIN (1 << 16)
+#define MERGE_MAXTHREADS 64
+
+struct merge {
+    // The sets, dst first, and where their fingerprints go in v.
+    const struct fp64set **sv;
+    size_t nsv;
+    size_t *off;
+    // The fingerprints, as exported, and partitioned by range.
+    uint64_t *v, *w;
+    size_t total;
+    // Row t: where thread t scatters the fingerprints of each range.
+    size_t *pos;
+    // The new buckets, 4 slots each.
+    uint64_t *bb;
+    size_t mask;
+    int logsize, nthreads;
+};
+
+struct mergeJob {
+    const struct merge *m;
+    int t;
+    // The partition of w filled by the thread; the fingerprints left
+    // for the fix-up are moved to its start.
+    size_t start, n;
+    size_t nout, cnt;
+};
+
+// The range of a bucket, and the first bucket of a range.
+static inline size_t mergeRange(size_t i, int nthreads, int logsize)
+{
+    return (uint64_t) i * nthreads >> logsize;
+}
+
+static inline size_t mergeRangeLo(size_t r, int nthreads, int logsize)
+{
+    return (((uint64_t) r << logsize) + nthreads - 1) / nthreads;
+}
+
+// Thread t's slice of v.
+static inline size_t mergeSliceLo(const struct merge *m, int t)
+{
+    return t == m->nthreads ? m->total : m->total / m->nthreads * t;
+}
+
+static void *mergeExport(void *arg)
+{
+    struct mergeJob *job = arg;
+    const struct merge *m = job->m;
+    for (size_t s = job->t; s < m->nsv; s += m->nthreads)
+	fp64set_export(m->sv[s], m->v + m->off[s], false);
+    return NULL;
+}
+
+static void *mergeCount(void *arg)
+{
+    struct mergeJob *job = arg;
+    const struct merge *m = job->m;
+    size_t *cnt = m->pos + job->t * m->nthreads;
+    for (size_t k = mergeSliceLo(m, job->t); k < mergeSliceLo(m, job->t + 1); k++)
+	cnt[mergeRange(Hash1(m->v[k], m->mask), m->nthreads, m->logsize)]++;
+    return NULL;
+}
+
+static void *mergeScatter(void *arg)
+{
+    struct mergeJob *job = arg;
+    const struct merge *m = job->m;
+    size_t *pos = m->pos + job->t * m->nthreads;
+    for (size_t k = mergeSliceLo(m, job->t); k < mergeSliceLo(m, job->t + 1); k++) {
+	uint64_t fp = m->v[k];
+	m->w[pos[mergeRange(Hash1(fp, m->mask), m->nthreads, m->logsize)]++] = fp;
+    }
+    return NULL;
+}
+
+// Make room in a full bucket by moving one of its fingerprints to its
+// alternative bucket, which must be in the range [lo, hi).
+static inline bool mergeMove(uint64_t fp, uint64_t *bb, uint64_t *b, size_t i,
+	size_t lo, size_t hi, size_t mask)
+{
+    for (int j = 0; j < 4; j++) {
+	uint64_t ofp = b[j];
+	size_t alt = Hash1(ofp, mask);
+	if (alt == i)
+	    alt = Hash2(ofp, mask);
+	if (alt == i || alt - lo >= hi - lo)
+	    continue;
+	if (justAdd1(ofp, bb + 4 * alt, alt, 4))
+	    return b[j] = fp, true;
+    }
+    return false;
+}
+
+static void *mergeInsert(void *arg)
+{
+    struct mergeJob *job = arg;
+    const struct merge *m = job->m;
+    uint64_t *bb = m->bb;
+    size_t mask = m->mask;
+    size_t lo = mergeRangeLo(job->t, m->nthreads, m->logsize);
+    size_t hi = mergeRangeLo(job->t + 1, m->nthreads, m->logsize);
+    uint64_t *v = m->w + job->start;
+    size_t n = job->n, nout = 0, cnt = 0;
+    for (size_t k = 0; k < n; k += 16) {
+	size_t g = n - k < 16 ? n - k : 16;
+	for (size_t j = 0; j < g; j++) {
+	    uint64_t fp = v[k+j];
+	    size_t i2 = Hash2(fp, mask);
+	    __builtin_prefetch(bb + 4 * Hash1(fp, mask));
+	    if (i2 - lo < hi - lo)
+		__builtin_prefetch(bb + 4 * i2);
+	}
+	for (size_t j = 0; j < g; j++) {
+	    uint64_t fp = v[k+j];
+	    size_t i1 = Hash1(fp, mask);
+	    size_t i2 = Hash2(fp, mask);
+	    // The second bucket, if it belongs to another thread,
+	    // is not even read.
+	    bool in2 = i2 - lo < hi - lo;
+	    if (!in2)
+		i2 = i1;
+	    uint64_t *b1 = bb + 4 * i1;
+	    uint64_t *b2 = bb + 4 * i2;
+	    if (has(fp, b1, b2, false, NULL, 4))
+		continue;
+	    if (justAdd2(fp, b1, i1, b2, i2, 4) ||
+		    mergeMove(fp, bb, b1, i1, lo, hi, mask) ||
+		    (in2 && mergeMove(fp, bb, b2, i2, lo, hi, mask)))
+		cnt++;
+	    else
+		v[nout++] = fp;
+	}
+    }
+    job->nout = nout;
+    job->cnt = cnt;
+    return NULL;
+}
+
+// Run fn for each job, on nthreads threads (the calling thread included).
+static void mergeRun(void *(*fn)(void *), struct mergeJob *jobs, int nthreads)
+{
+    pthread_t tid[nthreads];
+    bool started[nthreads];
+    for (int t = 0; t < nthreads; t++)
+	started[t] = t && pthread_create(&tid[t], NULL, fn, &jobs[t]) == 0;
+    for (int t = 0; t < nthreads; t++)
+	if (!started[t])
+	    fn(&jobs[t]);
+    for (int t = 0; t < nthreads; t++)
+	if (started[t])
+	    pthread_join(tid[t], NULL);
+}
+
+int fp64set_merge(struct fp64set *dst, const struct fp64set *const *srcs, size_t n, int nthreads)
+{
+    size_t total = fp64set_size(dst);
+    for (size_t s = 0; s < n; s++)
+	if (srcs[s] != dst)
+	    total += fp64set_size(srcs[s]);
+    // The new buckets are filled to at most 50%, which leaves most of the
+    // fingerprints a free slot in their first bucket.
+    int logsize = 4;
+    while (((size_t) 2 << logsize) < total)
+	logsize++;
+    if (logsize < dst->logsize)
+	logsize = dst->logsize;
+    // Small merges, and merges into a traced set, are done with fp64set_add().
+    if (nthreads <= 1 || total < MERGE_MIN || dst->trace || logsize > 32 ||
+	    (logsize > 26 && sizeof(size_t) < 5)) {
+	for (size_t s = 0; s < n; s++)
+	    if (srcs[s] != dst && addSet(dst, srcs[s]) < 0)
+		return -1;
+	return 0;
+    }
+    size_t nb = (size_t) 1 << logsize;
+    if (nthreads > MERGE_MAXTHREADS)
+	nthreads = MERGE_MAXTHREADS;
+    while (nthreads > 2 && nb / nthreads < 1024)
+	nthreads--;
+    struct mergeJob jobs[MERGE_MAXTHREADS];
+    struct merge m = {
+	.sv = malloc((n + 1) * sizeof *m.sv),
+	.off = malloc((n + 2) * sizeof(size_t)),
+	.v = malloc(total * sizeof(uint64_t)),
+	.w = malloc(total * sizeof(uint64_t)),
+	.total = total,
+	.pos = calloc(nthreads * nthreads, sizeof(size_t)),
+	.bb = calloc(4 * nb, sizeof(uint64_t)),
+	.mask = nb - 1,
+	.logsize = logsize,
+	.nthreads = nthreads,
+    };
+    int rc = -1;
+    if (!m.sv || !m.off || !m.v || !m.w || !m.pos || !m.bb) {
+	free(m.bb);
+	errno = ENOMEM;
+	goto out;
+    }
+    memset(A16(m.bb), 0xff, 4 * sizeof(uint64_t));
+    m.sv[m.nsv++] = dst;
+    for (size_t s = 0; s < n; s++)
+	if (srcs[s] != dst)
+	    m.sv[m.nsv++] = srcs[s];
+    m.off[0] = 0;
+    for (size_t s = 0; s < m.nsv; s++)
+	m.off[s+1] = m.off[s] + fp64set_size(m.sv[s]);
+    for (int t = 0; t < nthreads; t++)
+	jobs[t] = (struct mergeJob) { &m, t, 0, 0, 0, 0 };
+    mergeRun(mergeExport, jobs, nthreads);
+    mergeRun(mergeCount, jobs, nthreads);
+    // The counts become the positions, range by range.
+    size_t sum = 0;
+    for (int r = 0; r < nthreads; r++) {
+	jobs[r].start = sum;
+	for (int t = 0; t < nthreads; t++) {
+	    size_t c = m.pos[t * nthreads + r];
+	    m.pos[t * nthreads + r] = sum;
+	    sum += c;
+	}
+	jobs[r].n = sum - jobs[r].start;
+    }
+    mergeRun(mergeScatter, jobs, nthreads);
+    mergeRun(mergeInsert, jobs, nthreads);
+    // Switch dst to the new buckets, its fingerprints are in there now.
+    free(dst->bb);
+    dst->bb = m.bb;
+    dst->mask = m.mask;
+    dst->logsize = logsize;
+    dst->bsize = 4;
+    dst->cnt = 0;
+    for (int t = 0; t < nthreads; t++)
+	dst->cnt += jobs[t].cnt;
+    restash(dst, 0, 4);
+    // The prefilter has to grow, or else the old one is refilled.
+    if (dst->filter && !filterBuild(dst, dst->fbits)) {
+	memset(dst->filter, 0, (dst->fmask + 1) * sizeof(uint64_t));
+	for (size_t k = 0; k < total; k++)
+	    filterAdd(dst, m.v[k]);
+    }
+    // The fix-up.
+    rc = 0;
+    for (int t = 0; t < nthreads && rc == 0; t++)
+	rc = addAll(dst, m.w + jobs[t].start, jobs[t].nout);
+out:
+    free(m.sv);
+    free(m.off);
+    free(m.v);
+    free(m.w);
+    free(m.pos);
+    return rc;
+}
+
+// The copy of a big set is done in slices by several threads: with the
+// new buckets freshly allocated, most of the time goes to the page faults,
+// which then are handled in parallel.
+
+#define CLONE_SLICE (32 << 20)
+#define CLONE_MAXTHREADS 16
+
+struct cloneJob {
+    void *dst;
+    const void *src;
+    size_t n;
+};
+
+static void *cloneCopy(void *arg)
+{
+    struct cloneJob *job = arg;
+    memcpy(job->dst, job->src, job->n);
+    return NULL;
+}
+
+static void parallelCopy(void *dst, const void *src, size_t n)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = n / CLONE_SLICE;
+    if (nthreads > (size_t) ncpu)
+	nthreads = ncpu;
+    if (nthreads > CLONE_MAXTHREADS)
+	nthreads = CLONE_MAXTHREADS;
+    if (nthreads < 2) {
+	memcpy(dst, src, n);
+	return;
+    }
+    struct cloneJob jobs[CLONE_MAXTHREADS];
+    pthread_t tid[CLONE_MAXTHREADS];
+    bool started[CLONE_MAXTHREADS];
+    // The slices are page-aligned.
+    size_t slice = (n / nthreads + 4095) & ~(size_t) 4095;
+    for (size_t t = 0; t < nthreads; t++) {
+	size_t off = slice * t < n ? slice * t : n;
+	size_t end = off + slice < n ? off + slice : n;
+	jobs[t] = (struct cloneJob) { (char *) dst + off, (const char *) src + off, end - off };
+	started[t] = t && pthread_create(&tid[t], NULL, cloneCopy, &jobs[t]) == 0;
+    }
+    for (size_t t = 0; t < nthreads; t++)
+	if (!started[t])
+	    cloneCopy(&jobs[t]);
+    for (size_t t = 0; t < nthreads; t++)
+	if (started[t])
+	    pthread_join(tid[t], NULL);
+}
+
+struct fp64set *fp64set_clone(const struct fp64set *set)
+{
+    size_t bytes = set->bsize * ((size_t) set->mask + 1) * sizeof(uint64_t);
+    struct fp64set *clone = malloc(sizeof *clone);
+    uint64_t *bb = malloc(bytes);
+    uint64_t *filter = NULL;
+    if (set->filter)
+	filter = malloc((set->fmask + 1) * sizeof(uint64_t));
+    if (!clone || !bb || (set->filter && !filter))
+	return free(clone), free(bb), free(filter), NULL;
+    *clone = *set;
+    parallelCopy(bb, set->bb, bytes);
+    clone->bb = bb;
+    if (filter)
+	memcpy(filter, set->filter, (set->fmask + 1) * sizeof(uint64_t));
+    clone->filter = filter;
+    clone->trace = NULL;
+#if FP64SET_STATS
+    memset(&clone->stats, 0, sizeof clone->stats);
+#endif
+    resetVFuncs(clone);
+    return clone;
+}
+
+// A published set, with the number of references: one for each reader
+// holding it, and one while it is the current set.
+struct pubRef {
+    struct fp64set *set;
+    size_t refs;
+    struct pubRef *next;
+};
+
+struct fp64set_pub {
+    pthread_mutex_t mutex;
+    struct pubRef *cur;
+    // The sets which have been replaced, but are still held by readers.
+    struct pubRef *old;
+};
+
+struct fp64set_pub *fp64set_pub_new(void)
+{
+    struct fp64set_pub *pub = malloc(sizeof *pub);
+    if (!pub)
+	return NULL;
+    pthread_mutex_init(&pub->mutex, NULL);
+    pub->cur = pub->old = NULL;
+    return pub;
+}
+
+void fp64set_pub_free(struct fp64set_pub *pub)
+{
+    if (!pub)
+	return;
+    struct pubRef *r = pub->cur;
+    if (r)
+	r->next = pub->old;
+    else
+	r = pub->old;
+    while (r) {
+	struct pubRef *next = r->next;
+	fp64set_free(r->set);
+	free(r);
+	r = next;
+    }
+    pthread_mutex_destroy(&pub->mutex);
+    free(pub);
+}
+
+int fp64set_publish(struct fp64set_pub *pub, struct fp64set *set)
+{
+    struct pubRef *r = NULL;
+    if (set) {
+	r = malloc(sizeof *r);
+	if (!r)
+	    return -1;
+	r->set = set;
+	r->refs = 1;
+	r->next = NULL;
+    }
+    pthread_mutex_lock(&pub->mutex);
+    struct pubRef *old = pub->cur;
+    pub->cur = r;
+    if (old && --old->refs) {
+	old->next = pub->old;
+	pub->old = old;
+	old = NULL;
+    }
+    pthread_mutex_unlock(&pub->mutex);
+    // Nobody holds it, free outside the lock.
+    if (old) {
+	fp64set_free(old->set);
+	free(old);
+    }
+    return 0;
+}
+
+const struct fp64set *fp64set_acquire(struct fp64set_pub *pub)
+{
+    pthread_mutex_lock(&pub->mutex);
+    struct pubRef *r = pub->cur;
+    if (r)
+	r->refs++;
+    pthread_mutex_unlock(&pub->mutex);
+    return r ? r->set : NULL;
+}
+
+void fp64set_release(struct fp64set_pub *pub, const struct fp64set *set)
+{
+    if (!set)
+	return;
+    struct pubRef *dead = NULL;
+    pthread_mutex_lock(&pub->mutex);
+    if (pub->cur && pub->cur->set == set)
+	pub->cur->refs--;
+    else {
+	// The list of the old sets is short, unless some reader holds
+	// on to its set for too long.
+	for (struct pubRef **pr = &pub->old; *pr; pr = &(*pr)->next) {
+	    struct pubRef *r = *pr;
+	    if (r->set == set) {
+		if (--r->refs == 0) {
+		    *pr = r->next;
+		    dead = r;
+		}
+		break;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&pub->mutex);
+    if (dead) {
+	fp64set_free(dead->set);
+	free(dead);
+    }
+}
+
+#if FP64SET_STATS
+void fp64set_stats(const struct fp64set *set, struct fp64set_stats *st)
+{
+    // All the counters are uint64_t.
+    const uint64_t *src = (const uint64_t *) &set->stats;
+    uint64_t *dst = (uint64_t *) st;
+    for (size_t i = 0; i < sizeof *st / sizeof(uint64_t); i++)
+	dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+#endif
+
+int fp64set_kernel(const struct fp64set *set)
+{
+    return set->kernel;
+}
+
+int fp64set_set_kernel(struct fp64set *set, int kernel)
+{
+    if (kernel == FP64SET_KERNEL_SSE4 ? !HAVE_SSE4 :
+	    kernel != FP64SET_KERNEL_C && kernel != FP64SET_KERNEL_BRANCHY)
+	return errno = ENOTSUP, -1;
+    set->kernel = kernel;
+    // The wrappers, if any, are reinstalled on top.
+    resetVFuncs(set);
+    return 0;
+}
+
+// The number of lookups per round: the buckets they touch should not
+// all fit in the L2 cache, or else a large set would look like a small one.
+#define TUNE_N (1 << 14)
+#define TUNE_ROUNDS 3
+
+int fp64set_autotune(struct fp64set *set, int hitpct)
+{
+    assert(hitpct >= 0 && hitpct <= 100);
+    uint64_t *q = malloc(TUNE_N * sizeof(uint64_t));
+    if (!q)
+	return set->kernel;
+    // Random fingerprints are misses, for all practical purposes.
+    // Hits are picked from random buckets, skipping the empty ones.
+    const uint64_t *bb = set->bb;
+    size_t mask = set->mask;
+    size_t bsize = set->bsize;
+    uint64_t rnd = UINT64_C(0x9E3779B97F4A7C15);
+    for (size_t j = 0; j < TUNE_N; j++) {
+	rnd = rnd * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+	uint64_t fp = rnd ^ rnd >> 29;
+	if (set->cnt && (rnd >> 33) % 100 < (unsigned) hitpct) {
+	    size_t i = fp & mask;
+	    while (freeSlot(bb[bsize*i], i))
+		i = (i + 1) & mask;
+	    // Occupied slots go first.
+	    size_t k = (fp >> 32) % bsize;
+	    while (freeSlot(bb[bsize*i+k], i))
+		k--;
+	    fp = bb[bsize*i+k];
+	}
+	q[j] = fp;
+    }
+    // Each kernel gets its best time out of a few rounds; the kernels
+    // take turns, so that none of them is penalized by a cold cache.
+    uint64_t t[FP64SET_KERNEL_SSE4+1];
+    int kernel0 = set->kernel;
+    for (int k = 0; k <= FP64SET_KERNEL_SSE4; k++)
+	t[k] = UINT64_MAX;
+    for (int r = 0; r < TUNE_ROUNDS; r++) {
+	for (int k = 0; k <= FP64SET_KERNEL_SSE4; k++) {
+	    if (fp64set_set_kernel(set, k) < 0)
+		continue;
+	    // Calling the kernel directly, under the wrappers, so that the
+	    // lookups are neither filtered, nor traced, nor counted.
+	    int (FP64SET_FASTCALL *has)(FP64SET_pFP64, const struct fp64set *set) =
+		    set->filter ? set->fhas : set->trace ? set->thas : set->has;
+	    uint64_t t0 = nsecClock();
+	    for (size_t j = 0; j < TUNE_N; j++)
+		has(FP64SET_aFP64(q[j]), set);
+	    t0 = nsecClock() - t0;
+	    if (t0 < t[k])
+		t[k] = t0;
+	}
+    }
+    free(q);
+    // Ties go to the kernel already in use.
+    int best = kernel0;
+    for (int k = 0; k <= FP64SET_KERNEL_SSE4; k++)
+	if (t[k] < t[best])
+	    best = k;
+    fp64set_set_kernel(set, best);
+    return best;
+}
+
+// The frozen image starts with a header, padded to a cache line.
+struct frozenHeader {
+    char magic[8];
+    uint64_t nb;
+    uint64_t cnt;
+    uint64_t reserved[5];
+};
+
+static const char frozenMagic[8] = { 'f', 'p', '6', '4', 'f', 'r', 'z', '1' };
+
+// Map a 32-bit hash value to [0, nb) by multiplication.
+#define FrozenIndex(h, nb) ((uint32_t) (h) * (nb) >> 32)
+
+static FP64SET_FASTCALL int fp64set_frozen_has8(FP64SET_pFP64, const struct fp64set_frozen *fz)
+{
+    dFP;
+    size_t i1 = FrozenIndex(fp, fz->nb);
+    size_t i2 = FrozenIndex(fp >> 32, fz->nb);
+    const uint64_t *b1 = __builtin_assume_aligned(fz->bb + 8 * i1, 64);
+    const uint64_t *b2 = __builtin_assume_aligned(fz->bb + 8 * i2, 64);
+    // Branchless, both cache lines are loaded in parallel.
+    int has1 = (fp == b1[0]) | (fp == b1[1]) | (fp == b1[2]) | (fp == b1[3]);
+    int has2 = (fp == b2[0]) | (fp == b2[1]) | (fp == b2[2]) | (fp == b2[3]);
+    has1 |= (fp == b1[4]) | (fp == b1[5]) | (fp == b1[6]) | (fp == b1[7]);
+    has2 |= (fp == b2[4]) | (fp == b2[5]) | (fp == b2[6]) | (fp == b2[7]);
+    return has1 | has2;
+}
+
+// The SSE4 version only makes sense with 64-bit multiplication.
+#if defined(__x86_64__) && !defined(FP64SET_NOASM)
+HIDDEN FP64SET_FASTCALL int fp64set_frozen_has8sse4(FP64SET_pFP64, const struct fp64set_frozen *fz);
+#define SetFrozenVFunc(fz)				\
+do {							\
+    if (__builtin_cpu_supports("sse4.1"))		\
+	fz->has = fp64set_frozen_has8sse4;		\
+    else						\
+	fz->has = fp64set_frozen_has8;			\
+} while (0)
+#else
+#define SetFrozenVFunc(fz) fz->has = fp64set_frozen_has8
+#endif
+
+// Insert a fingerprint into the frozen buckets, the number of elements
+// in each bucket being tracked in fill[].  This is only done once, so
+// there is no point in optimizing the random walk; what matters is that
+// the walk does not get stuck at ~97% occupancy with 8-slot buckets.
+static bool frozenAdd(uint64_t fp, uint64_t *bb, uint8_t *fill, uint64_t nb, uint64_t *rnd)
+{
+    size_t i1 = FrozenIndex(fp, nb);
+    size_t i2 = FrozenIndex(fp >> 32, nb);
+    size_t i = fill[i1] <= fill[i2] ? i1 : i2;
+    for (int kick = 0; kick < 1000; kick++) {
+	if (fill[i] < 8) {
+	    bb[8 * i + fill[i]++] = fp;
+	    return true;
+	}
+	// Kick out a random victim.
+	*rnd = *rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+	uint64_t *slot = bb + 8 * i + (*rnd >> 61);
+	uint64_t ofp = *slot;
+	*slot = fp, fp = ofp;
+	size_t alt = FrozenIndex(fp, nb);
+	i = alt == i ? FrozenIndex(fp >> 32, nb) : alt;
+    }
+    return false;
+}
+
+static bool frozenFill(const struct fp64set *set, uint64_t *bb, uint8_t *fill, uint64_t nb)
+{
+    uint64_t rnd = 0;
+    size_t mask = set->mask;
+    size_t bsize = set->bsize;
+    for (size_t i = 0; i <= mask; i++) {
+	const uint64_t *b = set->bb + bsize * i;
+	for (size_t j = 0; j < bsize; j++)
+	    if (!freeSlot(b[j], i) && !frozenAdd(b[j], bb, fill, nb, &rnd))
+		return false;
+    }
+    for (size_t j = 0; j < set->nstash; j++)
+	if (!frozenAdd(set->stash[j], bb, fill, nb, &rnd))
+	    return false;
+    return true;
+}
+
+static struct fp64set_frozen *frozenNew(void *image, size_t imagesize, bool mapped)
+{
+    struct fp64set_frozen *fz = malloc(sizeof *fz);
+    if (!fz)
+	return NULL;
+    const struct frozenHeader *h = image;
+    SetFrozenVFunc(fz);
+    fz->bb = (const uint64_t *) (h + 1);
+    fz->nb = h->nb;
+    fz->cnt = h->cnt;
+    fz->image = image;
+    fz->imagesize = imagesize;
+    fz->mapped = mapped;
+    return fz;
+}
+
+struct fp64set_frozen *fp64set_freeze(const struct fp64set *set)
+{
+    size_t n = set->cnt + set->nstash;
+    // Target 97% occupancy, two buckets at the very least,
+    // so that the blank values work out.
+    uint64_t nb = (n + n / 32) / 8 + 2;
+    uint8_t *fill = NULL;
+    uint64_t *image = NULL;
+    while (1) {
+	// On 32-bit platforms, the image size can overflow.
+	if (nb > (SIZE_MAX - sizeof(struct frozenHeader)) / 64)
+	    return errno = ENOMEM, NULL;
+	size_t imagesize = sizeof(struct frozenHeader) + 64 * nb;
+	image = aligned_alloc(64, imagesize);
+	fill = calloc(nb, 1);
+	if (!image || !fill)
+	    break;
+	memset(image, 0, imagesize);
+	struct frozenHeader *h = (void *) image;
+	memcpy(h->magic, frozenMagic, sizeof frozenMagic);
+	h->nb = nb;
+	h->cnt = n;
+	uint64_t *bb = (void *) (h + 1);
+	memset(bb, 0xff, 64);
+	if (frozenFill(set, bb, fill, nb)) {
+	    // Re-blank the slots which fill[] says are free.
+	    for (size_t i = 0; i < nb; i++)
+		for (size_t j = fill[i]; j < 8; j++)
+		    bb[8 * i + j] = 0 - (i == 0);
+	    free(fill);
+	    struct fp64set_frozen *fz = frozenNew(image, imagesize, false);
+	    if (!fz)
+		free(image);
+	    return fz;
+	}
+	// Unlucky, retry with a few more buckets.
+	free(image);
+	free(fill);
+	nb += nb / 64 + 1;
+    }
+    free(image);
+    free(fill);
+    return NULL;
+}
+
+#ifndef _WIN32
+int fp64set_frozen_save(const struct fp64set_frozen *fz, const char *fname)
+{
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+	return -1;
+    const char *p = fz->image;
+    size_t left = fz->imagesize;
+    while (left) {
+	ssize_t ret = write(fd, p, left);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    int saveErrno = errno;
+	    close(fd);
+	    return errno = saveErrno, -1;
+	}
+	p += ret, left -= ret;
+    }
+    return close(fd);
+}
+
+struct fp64set_frozen *fp64set_frozen_load(const char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	int saveErrno = errno;
+	close(fd);
+	return errno = saveErrno, NULL;
+    }
+    size_t imagesize = st.st_size;
+    if ((off_t) imagesize != st.st_size || imagesize < sizeof(struct frozenHeader)) {
+	close(fd);
+	return errno = EINVAL, NULL;
+    }
+    void *image = mmap(NULL, imagesize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+	return NULL;
+    // The header must match the file size.
+    const struct frozenHeader *h = image;
+    if (memcmp(h->magic, frozenMagic, sizeof frozenMagic) || h->nb < 2 ||
+	    h->nb > (imagesize - sizeof *h) / 64 ||
+	    imagesize != sizeof *h + 64 * h->nb) {
+	munmap(image, imagesize);
+	return errno = EINVAL, NULL;
+    }
+    struct fp64set_frozen *fz = frozenNew(image, imagesize, true);
+    if (!fz)
+	munmap(image, imagesize);
+    return fz;
+}
+#endif
+
+void fp64set_frozen_free(struct fp64set_frozen *fz)
+{
+    if (!fz)
+	return;
+#ifndef _WIN32
+    if (fz->mapped)
+	munmap(fz->image, fz->imagesize);
+    else
+#endif
+	free(fz->image);
+    free(fz);
+}
+
+#ifndef _WIN32
+// A set in shared memory: the header with the scalar fields and the stash,
+// padded to a cache line, followed by the buckets and the prefilter words.
+// The pointers are set up by each process which attaches the segment.
+struct shmHeader {
+    // Written last, once the segment is complete.
+    char magic[8];
+    uint64_t cnt;
+    uint64_t fmask;
+    uint32_t mask;
+    uint8_t logsize, bsize, nstash, fbits;
+    // FP64SET_STASH, must match.
+    uint8_t stashSize;
+    uint8_t reserved1[7];
+    uint64_t stash[8];
+    uint64_t seed;
+    uint64_t reserved2[2];
+};
+
+static const char shmMagic[8] = { 'f', 'p', '6', '4', 's', 'h', 'm', '1' };
+
+static size_t shmSize(const struct shmHeader *h)
+{
+    size_t size = sizeof *h + h->bsize * ((size_t) h->mask + 1) * sizeof(uint64_t);
+    if (h->fbits)
+	size += (h->fmask + 1) * sizeof(uint64_t);
+    return size;
+}
+
+int fp64set_create_shm(const struct fp64set *set, const char *name)
+{
+    struct shmHeader hdr = {
+	.cnt = set->cnt,
+	.fmask = set->filter ? set->fmask : 0,
+	.mask = set->mask,
+	.logsize = set->logsize,
+	.bsize = set->bsize,
+	.nstash = set->nstash,
+	.fbits = set->filter ? set->fbits : 0,
+	.stashSize = FP64SET_STASH,
+	.seed = set->seed,
+    };
+    memcpy(hdr.stash, set->stash, sizeof set->stash);
+    size_t size = shmSize(&hdr);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+	return -1;
+    void *image = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+	image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int saveErrno = errno;
+    close(fd);
+    if (image == MAP_FAILED) {
+	shm_unlink(name);
+	return errno = saveErrno, -1;
+    }
+    struct shmHeader *h = image;
+    *h = hdr;
+    size_t bytes = set->bsize * ((size_t) set->mask + 1) * sizeof(uint64_t);
+    parallelCopy(h + 1, set->bb, bytes);
+    if (hdr.fbits)
+	memcpy((char *) (h + 1) + bytes, set->filter, (hdr.fmask + 1) * sizeof(uint64_t));
+    // The segment is zero-filled, and the readers check the magic.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, shmMagic, sizeof shmMagic);
+    munmap(image, size);
+    return 0;
+}
+
+const struct fp64set *fp64set_attach_shm(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+	return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	int saveErrno = errno;
+	close(fd);
+	return errno = saveErrno, NULL;
+    }
+    size_t size = st.st_size;
+    if ((off_t) size != st.st_size || size < sizeof(struct shmHeader)) {
+	close(fd);
+	return errno = EINVAL, NULL;
+    }
+    void *image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+	return NULL;
+    const struct shmHeader *h = image;
+    int err = 0;
+    if (memcmp(h->magic, shmMagic, sizeof shmMagic))
+	err = memcmp(h->magic, "\0\0\0\0\0\0\0\0", 8) ? EINVAL : EAGAIN;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // The fields are checked for consistency with the segment size.
+    if (err == 0 && (h->stashSize != FP64SET_STASH || h->nstash > FP64SET_STASH ||
+	    h->logsize < 4 || h->logsize > 32 ||
+	    h->mask != (uint32_t) (((uint64_t) 1 << h->logsize) - 1) ||
+	    h->bsize < 2 || h->bsize > 4 ||
+	    (h->fbits && h->fmask > (size - sizeof *h) / sizeof(uint64_t)) ||
+	    size != shmSize(h)))
+	err = EINVAL;
+    struct fp64set *set = NULL;
+    if (err == 0 && !(set = malloc(sizeof *set)))
+	err = errno;
+    if (err) {
+	munmap(image, size);
+	return errno = err, NULL;
+    }
+    set->bb = (uint64_t *) (h + 1);
+    set->cnt = h->cnt;
+    set->mask = h->mask;
+    set->logsize = h->logsize;
+    set->bsize = h->bsize;
+    set->nstash = h->nstash;
+    memcpy(set->stash, h->stash, sizeof set->stash);
+    set->fbits = h->fbits;
+    set->fmask = h->fmask;
+    set->filter = NULL;
+    if (h->fbits)
+	set->filter = set->bb + h->bsize * ((size_t) h->mask + 1);
+    set->trace = NULL;
+    set->seed = h->seed;
+#if FP64SET_STATS
+    memset(&set->stats, 0, sizeof set->stats);
+#endif
+    set->kernel = HAVE_SSE4 ? FP64SET_KERNEL_SSE4 : FP64SET_KERNEL_C;
+    resetVFuncs(set);
+    return set;
+}
+
+void fp64set_detach_shm(const struct fp64set *set)
+{
+    if (!set)
+	return;
+    struct shmHeader *h = (struct shmHeader *) set->bb - 1;
+    munmap(h, shmSize(h));
+    free((struct fp64set *) set);
+}
+#endif
+
+// The windowed set: each bucket is a cache line, with 5 fingerprints and
+// the generations in which they were last added (or, in a counting set,
+// the counts).  A slot is occupied if its fingerprint was added within
+// the window; expired slots are reused as free ones, and also the blank
+// values, as in the live set, mark the slots which have never been used
+// or have been swept.
+#define WIN_SLOTS 5
+
+// Must match fp64set-x86.S.
+struct winBucket {
+    uint64_t fp[WIN_SLOTS];
+    uint32_t val[WIN_SLOTS + 1];
+};
+
+#define WinBuckets(w) ((struct winBucket *) (w)->bb)
+
+// The generations are compared modulo 2^32.  This is only valid if no
+// slot is older than 2^32 generations, hence the sweep every 2^31 steps.
+// The window of 0 never expires anything, for the counting sets.
+static inline bool winFresh(const struct fp64set_window *w, uint32_t gen)
+{
+    return w->gen - gen <= w->window - 1;
+}
+
+static inline bool winFree(const struct fp64set_window *w,
+	const struct winBucket *b, int j, size_t i)
+{
+    return freeSlot(b->fp[j], i) || !winFresh(w, b->val[j]);
+}
+
+// Returns the first free slot in the bucket, or -1; also counts them.
+static inline int winFreeSlot(const struct fp64set_window *w,
+	const struct winBucket *b, size_t i, int *nfree)
+{
+    int slot = -1;
+    *nfree = 0;
+    for (int j = WIN_SLOTS - 1; j >= 0; j--)
+	if (winFree(w, b, j, i))
+	    slot = j, ++*nfree;
+    return slot;
+}
+
+static FP64SET_FASTCALL int fp64set_window_has5(FP64SET_pFP64, const struct fp64set_window *w)
+{
+    dFP;
+    size_t mask = w->mask;
+    const struct winBucket *b1 = WinBuckets(w) + Hash1(fp, mask);
+    const struct winBucket *b2 = WinBuckets(w) + Hash2(fp, mask);
+    // A fingerprint never equals a blank value in its own buckets, and
+    // is found in at most one slot, whose generation is then picked up.
+    // Branchless, both cache lines are loaded in parallel.
+    int has = 0;
+    uint32_t gen = 0;
+    for (int j = 0; j < WIN_SLOTS; j++) {
+	int has1 = fp == b1->fp[j];
+	int has2 = fp == b2->fp[j];
+	gen |= (b1->val[j] & -has1) | (b2->val[j] & -has2);
+	has |= has1 | has2;
+    }
+    return has & winFresh(w, gen);
+}
+
+#if defined(__x86_64__) && !defined(FP64SET_NOASM)
+HIDDEN FP64SET_FASTCALL int fp64set_window_has5sse4(FP64SET_pFP64, const struct fp64set_window *w);
+#define SetWindowVFunc(w)				\
+do {							\
+    if (__builtin_cpu_supports("sse4.1"))		\
+	w->has = fp64set_window_has5sse4;		\
+    else						\
+	w->has = fp64set_window_has5;			\
+} while (0)
+#else
+#define SetWindowVFunc(w) w->has = fp64set_window_has5
+#endif
+
+static struct winBucket *winBuckets(int logsize)
+{
+    size_t nb = (size_t) 1 << logsize;
+    struct winBucket *bb = aligned_alloc(64, nb * sizeof *bb);
+    if (!bb)
+	return NULL;
+    memset(bb, 0, nb * sizeof *bb);
+    for (int j = 0; j < WIN_SLOTS; j++)
+	bb[0].fp[j] = UINT64_MAX;
+    return bb;
+}
+
+static bool winInit(struct fp64set_window *w, int logsize, uint32_t window)
+{
+    assert(logsize >= 0);
+    // Each bucket takes 5 fingerprints, so starting with 1/4 as many.
+    logsize -= 2;
+    if (logsize < 4)
+	logsize = 4;
+    if (logsize > 27 && sizeof(size_t) < 5)
+	return errno = ENOMEM, false;
+    if (logsize > 32)
+	return errno = E2BIG, false;
+    w->bb = winBuckets(logsize);
+    if (!w->bb)
+	return false;
+    SetWindowVFunc(w);
+    w->mask = ((size_t) 1 << logsize) - 1;
+    w->logsize = logsize;
+    w->gen = 0;
+    w->window = window;
+    w->rnd = 0;
+    return true;
+}
+
+struct fp64set_window *fp64set_window_new(int logsize, uint32_t window)
+{
+    assert(window >= 1 && window <= (uint32_t) 1 << 31);
+    struct fp64set_window *w = malloc(sizeof *w);
+    if (!w)
+	return NULL;
+    if (!winInit(w, logsize, window))
+	return free(w), NULL;
+    return w;
+}
+
+void fp64set_window_free(struct fp64set_window *w)
+{
+    if (!w)
+	return;
+    free(w->bb);
+    free(w);
+}
+
+// Put a new fingerprint into either of its buckets, making room with a
+// random walk if need be.  If the walk fails, another fingerprint is left
+// over in *fp and *val.
+static bool winPut(struct fp64set_window *w, struct winBucket *bb, size_t mask,
+	uint64_t *fp, uint32_t *val)
+{
+    size_t i1 = Hash1(*fp, mask);
+    size_t i2 = Hash2(*fp, mask);
+    int n1, n2;
+    int j1 = winFreeSlot(w, bb + i1, i1, &n1);
+    int j2 = winFreeSlot(w, bb + i2, i2, &n2);
+    // Prefer the bucket with more free slots.
+    size_t i = n1 >= n2 ? i1 : i2;
+    int j = n1 >= n2 ? j1 : j2;
+    int nfree;
+    for (int kick = 0; j < 0 && kick < 500; kick++) {
+	w->rnd = w->rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+	j = (w->rnd >> 32) % WIN_SLOTS;
+	struct winBucket *b = bb + i;
+	uint64_t ofp = b->fp[j];
+	uint32_t oval = b->val[j];
+	b->fp[j] = *fp, b->val[j] = *val;
+	*fp = ofp, *val = oval;
+	size_t alt = Hash1(ofp, mask);
+	i = alt == i ? Hash2(ofp, mask) : alt;
+	j = winFreeSlot(w, bb + i, i, &nfree);
+    }
+    if (j < 0)
+	return false;
+    bb[i].fp[j] = *fp;
+    bb[i].val[j] = *val;
+    return true;
+}
+
+// Double the buckets, moving over the fresh fingerprints.
+static bool winGrow(struct fp64set_window *w)
+{
+    int logsize = w->logsize;
+    while (1) {
+	if (++logsize > 32 || (logsize > 27 && sizeof(size_t) < 5))
+	    return errno = E2BIG, false;
+	size_t mask = ((size_t) 1 << logsize) - 1;
+	struct winBucket *bb = winBuckets(logsize);
+	if (!bb)
+	    return false;
+	bool ok = true;
+	for (size_t i = 0; ok && i <= w->mask; i++) {
+	    const struct winBucket *b = WinBuckets(w) + i;
+	    for (int j = 0; ok && j < WIN_SLOTS; j++) {
+		uint64_t fp = b->fp[j];
+		uint32_t val = b->val[j];
+		if (!winFree(w, b, j, i))
+		    ok = winPut(w, bb, mask, &fp, &val);
+	    }
+	}
+	if (ok) {
+	    free(w->bb);
+	    w->bb = bb;
+	    w->mask = mask;
+	    w->logsize = logsize;
+	    return true;
+	}
+	// Very unlikely at half the load, but then try yet bigger.
+	free(bb);
+    }
+}
+
+// The slot's value, if the fingerprint is there (expired or not).
+// Branchless, like fp64set_window_has5(): the address of the one slot
+// which matches, if any, is or'ed together.
+static inline uint32_t *winFind(const struct fp64set_window *w, uint64_t fp)
+{
+    size_t mask = w->mask;
+    struct winBucket *b1 = WinBuckets(w) + Hash1(fp, mask);
+    struct winBucket *b2 = WinBuckets(w) + Hash2(fp, mask);
+    uintptr_t val = 0;
+    for (int j = 0; j < WIN_SLOTS; j++) {
+	val |= (uintptr_t) &b1->val[j] & -(uintptr_t) (fp == b1->fp[j]);
+	val |= (uintptr_t) &b2->val[j] & -(uintptr_t) (fp == b2->fp[j]);
+    }
+    return (uint32_t *) val;
+}
+
+// Insert a new fingerprint, returns 1, or 2 after a resize, or -1.
+static int winInsert(struct fp64set_window *w, uint64_t fp, uint32_t val)
+{
+    if (winPut(w, WinBuckets(w), w->mask, &fp, &val))
+	return 1;
+    // Another fingerprint is left over, and goes in after the resize.
+    // If the resize fails, it is lost, as if expired early.
+    do
+	if (!winGrow(w))
+	    return -1;
+    while (!winPut(w, WinBuckets(w), w->mask, &fp, &val));
+    return 2;
+}
+
+int fp64set_window_add(struct fp64set_window *w, uint64_t fp)
+{
+    // Refresh the fingerprint, expired or not.
+    uint32_t *gen = winFind(w, fp);
+    if (gen) {
+	int rc = !winFresh(w, *gen);
+	*gen = w->gen;
+	return rc;
+    }
+    return winInsert(w, fp, w->gen);
+}
+
+// Blank out the expired slots, so that none gets older than 2^32.
+static void winSweep(struct fp64set_window *w)
+{
+    for (size_t i = 0; i <= w->mask; i++) {
+	struct winBucket *b = WinBuckets(w) + i;
+	for (int j = 0; j < WIN_SLOTS; j++)
+	    if (winFree(w, b, j, i))
+		b->fp[j] = 0 - (uint64_t) (i == 0);
+    }
+}
+
+void fp64set_window_advance(struct fp64set_window *w)
+{
+    if ((++w->gen & 0x7fffffff) == 0)
+	winSweep(w);
+}
+
+// The counting set is a windowed set which never expires anything,
+// and the slots hold the counts instead of the generations.
+struct fp64set_counter *fp64set_counter_new(int logsize)
+{
+    struct fp64set_counter *c = malloc(sizeof *c);
+    if (!c)
+	return NULL;
+    if (!winInit(&c->w, logsize, 0))
+	return free(c), NULL;
+    c->cnt = 0;
+    return c;
+}
+
+void fp64set_counter_free(struct fp64set_counter *c)
+{
+    if (!c)
+	return;
+    free(c->w.bb);
+    free(c);
+}
+
+uint32_t fp64set_counter_add(struct fp64set_counter *c, uint64_t fp)
+{
+    uint32_t *n = winFind(&c->w, fp);
+    if (n) {
+	if (*n < UINT32_MAX)
+	    ++*n;
+	return *n;
+    }
+    // On failure, either this or another fingerprint is left out,
+    // so the number of fingerprints stays the same.
+    if (winInsert(&c->w, fp, 1) < 0)
+	return 0;
+    c->cnt++;
+    return 1;
+}
+
+uint32_t fp64set_counter_get(const struct fp64set_counter *c, uint64_t fp)
+{
+    const uint32_t *n = winFind(&c->w, fp);
+    return n ? *n : 0;
+}
+
+// The export keeps a min-heap of the top counts found so far; the ties
+// are broken by the fingerprint, so that the output is deterministic.
+static inline bool countLess(const struct fp64set_count *a, const struct fp64set_count *b)
+{
+    return a->count < b->count || (a->count == b->count && a->fp > b->fp);
+}
+
+static void countSiftDown(struct fp64set_count *h, size_t n, size_t i)
+{
+    struct fp64set_count x = h[i];
+    while (1) {
+	size_t k = 2 * i + 1;
+	if (k >= n)
+	    break;
+	if (k + 1 < n && countLess(&h[k+1], &h[k]))
+	    k++;
+	if (!countLess(&h[k], &x))
+	    break;
+	h[i] = h[k], i = k;
+    }
+    h[i] = x;
+}
+
+static void countSiftUp(struct fp64set_count *h, size_t i)
+{
+    struct fp64set_count x = h[i];
+    while (i > 0) {
+	size_t k = (i - 1) / 2;
+	if (!countLess(&x, &h[k]))
+	    break;
+	h[i] = h[k], i = k;
+    }
+    h[i] = x;
+}
+
+size_t fp64set_counter_export(const struct fp64set_counter *c, uint32_t threshold,
+	struct fp64set_count *out, size_t k)
+{
+    if (k == 0)
+	return 0;
+    size_t n = 0;
+    for (size_t i = 0; i <= c->w.mask; i++) {
+	const struct winBucket *b = WinBuckets(&c->w) + i;
+	for (int j = 0; j < WIN_SLOTS; j++) {
+	    if (freeSlot(b->fp[j], i) || b->val[j] < threshold)
+		continue;
+	    struct fp64set_count x = { b->fp[j], b->val[j] };
+	    if (n < k) {
+		out[n] = x;
+		countSiftUp(out, n++);
+	    }
+	    else if (countLess(&out[0], &x)) {
+		out[0] = x;
+		countSiftDown(out, n, 0);
+	    }
+	}
+    }
+    // Pop the minimums to the end, which leaves the counts descending.
+    for (size_t m = n; m > 1; m--) {
+	struct fp64set_count x = out[0];
+	out[0] = out[m-1];
+	out[m-1] = x;
+	countSiftDown(out, m - 1, 0);
+    }
+    return n;
+}
+
 // ex:set ts=8 sts=4 sw=4 noet:
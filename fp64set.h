@@ -67,12 +67,57 @@ void fp64set_free(struct fp64set *set);
 #define FP64SET_aFP64(fp) fp
 #endif
 
+// The number of stash slots: 2, 4, 6, or 8.  The stash is checked with SSE
+// compares, two slots at a time, so the number must be even.  Each extra
+// pair of slots costs one more compare in has(), but further reduces the
+// chances that fp64set_add() fails or resizes prematurely.  This affects
+// the layout of the structure, so the whole program must agree on it.
+#ifndef FP64SET_STASH
+#define FP64SET_STASH 4
+#endif
+
+// Build with -DFP64SET_STATS=1 to collect the statistics below, readable
+// with fp64set_stats().  This also affects the layout of the structure.
+// Without it, there is no overhead.
+#ifndef FP64SET_STATS
+#define FP64SET_STATS 0
+#endif
+
+#if FP64SET_STATS
+#define FP64SET_STATS_KICKS 32
+struct fp64set_stats {
+    // Insertions which needed evictions, by the number of kicks (with
+    // FP64SET_BFS, the length of the eviction path), the last bin also
+    // counting the longer ones; and the walks that found no free slot.
+    uint64_t kicks[FP64SET_STATS_KICKS];
+    uint64_t kickfail;
+    // Fingerprints put into the stash, and moved back to the buckets.
+    uint64_t stashed, unstashed;
+    // Resizes by type: 2->3, 3->4, and 4->3 which doubles the buckets;
+    // the time spent in nanoseconds, and the bytes moved, i.e. the size
+    // of the buckets before the resize.
+    uint64_t resize[3], resizeNsec[3], resizeBytes[3];
+    // The values returned by fp64set_add(), -1..2, at index rc + 1.
+    uint64_t add[4];
+    // Misses and hits of fp64set_has() and fp64set_has_batch().
+    uint64_t has[2];
+};
+
+// The counters are written without atomic read-modify-write operations:
+// a reader sees each counter consistent (although not all of them taken
+// at the same time), but when several threads call fp64set_has() at once,
+// some of the hits and misses can get lost.
+#define FP64SET_STATS_ADD(var, n) \
+    __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+#endif
+
 // Expose the structure, to inline vfunc calls.
 struct fp64set {
-    // To reduce the failure rate, one or two fingerprints can be stashed.
-    // When only one fingerprint is stashed, we have stash[0] == stash[1].
+    // To reduce the failure rate, a few fingerprints can be stashed.
+    // The unused slots hold copies of stash[0], so that the whole stash
+    // can be checked unconditionally once at least one element is stashed.
     // This guy had better be aligned to a 16-byte boundary, so it goes first.
-    uint64_t stash[2];
+    uint64_t stash[FP64SET_STASH];
     // Virtual functions, depend on the bucket size, switched on resize.
     // Pass fp arg first, eax:edx may hold hash() return value.
     int (FP64SET_FASTCALL *add)(FP64SET_pFP64, struct fp64set *set);
@@ -89,8 +134,29 @@ struct fp64set {
     uint8_t logsize;
     // The number of slots in each bucket: 2, 3, or 4.
     uint8_t bsize;
-    // The number of fingerprints stashed: 0, 1, or 2.
+    // The number of fingerprints stashed: 0..FP64SET_STASH.
     uint8_t nstash;
+    // The optional prefilter, see fp64set_prefilter(): bits per slot,
+    // the words (malloc'd), and the number of words - 1.
+    uint8_t fbits;
+    // The lookup/insert kernel, see fp64set_kernel().
+    uint8_t kernel;
+    uint64_t *filter;
+    size_t fmask;
+    // When the prefilter is enabled, add and has point to the wrappers
+    // which consult the filter, and the actual routines go here.
+    int (FP64SET_FASTCALL *fadd)(FP64SET_pFP64, struct fp64set *set);
+    int (FP64SET_FASTCALL *fhas)(FP64SET_pFP64, const struct fp64set *set);
+    // Likewise, when the calls are being traced, see fp64set_trace().
+    struct fp64set_trace *trace;
+    int (FP64SET_FASTCALL *tadd)(FP64SET_pFP64, struct fp64set *set);
+    int (FP64SET_FASTCALL *thas)(FP64SET_pFP64, const struct fp64set *set);
+    // The seed with which byte keys are hashed, see fp64set_add_bytes().
+    uint64_t seed;
+#if FP64SET_STATS
+    // Written through a const set by fp64set_has().
+    struct fp64set_stats stats;
+#endif
 };
 
 // Add a 64-bit fingerprint to the set.  Returns 0 for a previously added
@@ -105,7 +171,13 @@ struct fp64set {
 // of this kind of failure decreases exponentially with logsize.
 static inline int fp64set_add(struct fp64set *set, uint64_t fp)
 {
+#if FP64SET_STATS
+    int rc = set->add(FP64SET_aFP64(fp), set);
+    FP64SET_STATS_ADD(set->stats.add[rc+1], 1);
+    return rc;
+#else
     return set->add(FP64SET_aFP64(fp), set);
+#endif
 }
 
 // Check if a fingerprint is in the set.
@@ -114,9 +186,337 @@ static inline bool fp64set_has(const struct fp64set *set, uint64_t fp)
     // An implementation detail: set->has returns int because in SSE assembly
     // we can simply do "pmovmskb %xmm,%eax".  Conversion to bool can usually
     // be optimized out - the compiler should "test %eax,%eax" instead of %al.
+#if FP64SET_STATS
+    bool ret = set->has(FP64SET_aFP64(fp), set);
+    struct fp64set *mset = (struct fp64set *) set;
+    FP64SET_STATS_ADD(mset->stats.has[ret], 1);
+    return ret;
+#else
     return set->has(FP64SET_aFP64(fp), set);
+#endif
+}
+
+#if FP64SET_STATS
+// Take a snapshot of the statistics; this can be done by another thread,
+// while the set is being modified.
+void fp64set_stats(const struct fp64set *set, struct fp64set_stats *st);
+#endif
+
+// Maintain a small Bloom-like filter alongside the buckets, with the given
+// number of bits per slot (e.g. 8; 0 disables the filter).  With 8 bits,
+// the filter takes 1/8 of the memory used by the buckets, and a lookup
+// that misses in the set is usually answered with a single probe into
+// the filter, without touching the buckets.  This is worthwhile when most
+// lookups are misses, and the filter fits in the cache while the buckets
+// do not.  The filter grows when the set resizes.  Returns 0 on success,
+// -1 on malloc failure.
+int fp64set_prefilter(struct fp64set *set, int bits);
+
+// Check a batch of fingerprints, out[i] = fp64set_has(set, fpv[i]).
+// The buckets are prefetched in groups, for the fingerprints which pass
+// the prefilter (if enabled).  Returns the number of fingerprints found.
+size_t fp64set_has_batch(const struct fp64set *set, const uint64_t *fpv, size_t n, bool *out);
+
+// A seeded 64-bit hash of a byte string, the one used by the functions
+// below.  Both 32-bit halves, which serve as the two cuckoo hashes, depend
+// on all the bits.  Not a cryptographic hash: the keys should not be
+// chosen by an adversary who knows the seed.
+uint64_t fp64set_hash(const void *key, size_t len, uint64_t seed);
+
+// Add or look up byte keys, hashed with the seed stored in the set (0 in
+// a new set).  The return values are those of fp64set_add() and
+// fp64set_has().
+static inline int fp64set_add_bytes(struct fp64set *set, const void *key, size_t len)
+{
+    return fp64set_add(set, fp64set_hash(key, len, set->seed));
+}
+
+static inline bool fp64set_has_bytes(const struct fp64set *set, const void *key, size_t len)
+{
+    return fp64set_has(set, fp64set_hash(key, len, set->seed));
+}
+
+// The same for a batch of keys, the i-th key being keys[i] of lens[i]
+// bytes.  The keys are hashed in groups, and the buckets are prefetched
+// before the group is added or looked up.  fp64set_add_bytes_batch()
+// stores the return values of fp64set_add() in rc, and stops at the
+// first failure; returns the number of keys processed.
+// fp64set_has_bytes_batch() returns the number of keys found.
+size_t fp64set_add_bytes_batch(struct fp64set *set, const void *const *keys,
+	const size_t *lens, size_t n, int *rc);
+size_t fp64set_has_bytes_batch(const struct fp64set *set, const void *const *keys,
+	const size_t *lens, size_t n, bool *out);
+
+// When fp64set_add_bytes() fails with EAGAIN, the set must be rebuilt from
+// the keys with another seed.  This empties the set, switches to the next
+// seed, and adds the keys (which must include the one that failed), trying
+// a few more seeds if need be.  The geometry of the set and the prefilter
+// are kept.  Returns 0 on success, -1 on failure (ENOMEM, or EAGAIN if no
+// seed worked), in which case the set is left with a part of the keys.
+int fp64set_reseed(struct fp64set *set, const void *const *keys, const size_t *lens, size_t n);
+
+// The number of fingerprints in the set.
+static inline size_t fp64set_size(const struct fp64set *set)
+{
+    return set->cnt + set->nstash;
+}
+
+// Call fn for each fingerprint in the set, in no particular order.
+// The set must not be modified until fp64set_foreach() returns.
+void fp64set_foreach(const struct fp64set *set, void (*fn)(uint64_t fp, void *arg), void *arg);
+
+// Copy the fingerprints into out, which must have room for fp64set_size()
+// elements; returns the number of fingerprints.  The buckets are scanned
+// sequentially, which is much faster than fp64set_foreach().  With sorted,
+// the output is sorted in ascending order, for merge-joins with other
+// data; the sort needs a temporary buffer of the same size, and fails
+// with SIZE_MAX (ENOMEM) if it cannot be allocated.
+size_t fp64set_export(const struct fp64set *set, uint64_t *out, bool sorted);
+
+// Set algebra: dst = a | b, a & b, or a - b.  The result goes either into
+// a (in place), or into another set, usually a new one, to which it is
+// added (for the difference, dst cannot be b).  When a and b have the same
+// layout (e.g. they were created with the same logsize and filled to about
+// the same size), their buckets are compared sequentially, in lockstep.
+// In place, the intersection and the difference remove fingerprints from
+// a, which cannot fail (and are not recorded in the trace, if any).
+// Otherwise, the result is added with fp64set_add(); returns 0 on success,
+// -1 on failure, just like fp64set_add().
+int fp64set_union(struct fp64set *dst, const struct fp64set *a, const struct fp64set *b);
+int fp64set_intersect(struct fp64set *dst, const struct fp64set *a, const struct fp64set *b);
+int fp64set_difference(struct fp64set *dst, const struct fp64set *a, const struct fp64set *b);
+
+// The same, with a's buckets split into ranges processed by nthreads
+// threads (the calling thread included).  No other thread may modify a or
+// b meanwhile.  The union is not parallelized, since it adds to dst.
+int fp64set_intersect_mt(struct fp64set *dst, const struct fp64set *a,
+	const struct fp64set *b, int nthreads);
+int fp64set_difference_mt(struct fp64set *dst, const struct fp64set *a,
+	const struct fp64set *b, int nthreads);
+
+// Add the fingerprints of n sets to dst, e.g. the sets built by several
+// threads, on nthreads threads.  dst is rebuilt with room for all of them
+// (at most half full, with 4 slots per bucket), and each thread fills its
+// own range of the new buckets; the few fingerprints that do not fit in
+// their range are then added with fp64set_add().  Duplicates are added
+// once.  Small merges, or merges into a traced set, are done with
+// fp64set_add() on the calling thread.  The parallel merge takes two
+// temporary arrays of 8 bytes per fingerprint.  Returns 0 on success, -1
+// on failure, just like fp64set_add(); on malloc failure before the
+// rebuild, dst is left intact.
+int fp64set_merge(struct fp64set *dst, const struct fp64set *const *srcs, size_t n, int nthreads);
+
+// Make a copy of the set, e.g. for a checkpoint, or to be published to
+// reader threads.  The buckets are copied with memcpy (in parallel for big
+// sets); the copy has the same kernel and prefilter, but is not traced,
+// and its statistics start at zero.  Returns NULL on malloc failure.
+struct fp64set *fp64set_clone(const struct fp64set *set);
+
+// Publish sets to reader threads.  The writer publishes a set (typically
+// a clone, which it then no longer modifies), which replaces the previous
+// one.  A reader acquires the current set (NULL if none), runs its lookups,
+// and releases the set.  Each set is freed once it has been replaced and
+// released by all the readers.  Acquiring takes a mutex, so it should be
+// done once per batch of lookups, not per lookup.
+struct fp64set_pub *fp64set_pub_new(void);
+void fp64set_pub_free(struct fp64set_pub *pub);
+
+// Takes the ownership of the set.  Returns 0 on success, -1 on malloc
+// failure (the set is then not published, and still belongs to the caller).
+int fp64set_publish(struct fp64set_pub *pub, struct fp64set *set);
+const struct fp64set *fp64set_acquire(struct fp64set_pub *pub);
+void fp64set_release(struct fp64set_pub *pub, const struct fp64set *set);
+
+// The kernels which implement fp64set_has() and fp64set_add().  The portable
+// one is branchless (see the comment on has() in fp64set.c); the branchy one
+// returns as soon as the fingerprint is found, which can be faster when the
+// outcome of lookups is predictable, e.g. when nearly all of them are misses.
+// By default, SSE4 assembly is used when the CPU supports it.
+#define FP64SET_KERNEL_C	0
+#define FP64SET_KERNEL_BRANCHY	1
+#define FP64SET_KERNEL_SSE4	2
+
+// Which kernel the set is using.
+int fp64set_kernel(const struct fp64set *set);
+
+// Switch to another kernel.  Returns 0 on success, -1 if the kernel is
+// not available on this CPU or in this build (ENOTSUP).
+int fp64set_set_kernel(struct fp64set *set, int kernel);
+
+// Time lookups with each kernel available, on a mix of fingerprints drawn
+// from the set and random ones, with hitpct percent of hits (0..100), and
+// switch to the fastest kernel.  Since the timings depend on the size of
+// the set, this should be called once the set is (mostly) filled, with the
+// hit ratio observed in the application.  The kernel is chosen by the
+// lookups alone, fp64set_add() switches along with fp64set_has().  The
+// prefilter and the trace, if enabled, are bypassed during the timing.
+// Returns the kernel selected.
+int fp64set_autotune(struct fp64set *set, int hitpct);
+
+// Record the calls to fp64set_add() and fp64set_has() (fp64set_has_batch()
+// included), with their return values, into a file, to be replayed later
+// (see replay.c).  If the set is not empty, its contents is recorded first.
+// A NULL fname stops the recording.  Returns 0 on success, -1 on error
+// (with errno set); when the recording stops, -1 means that some of the
+// records could not be written.  Lookups from several threads can be
+// traced: each record is appended under a lock, and the records of
+// different threads come out in the order in which they took the lock.
+// Starting and stopping the recording must not race with the lookups.
+int fp64set_trace(struct fp64set *set, const char *fname);
+
+// The trace file starts with the header below, followed by 9-byte records:
+// the op in the low 4 bits of the first byte, the return value + 1 in the
+// high 4 bits, and the fingerprint, in the native byte order.
+struct fp64set_trace_header {
+    char magic[8];	// "fp64trc1"
+    uint8_t logsize;	// set->logsize when the recording started
+    uint8_t stash;	// FP64SET_STASH, affects the return values
+    uint8_t reserved[6];
+};
+
+#define FP64SET_TRACE_LOAD	1 // the set's contents when the recording started
+#define FP64SET_TRACE_ADD	2
+#define FP64SET_TRACE_HAS	3
+#define FP64SET_TRACE_RECSIZE	9
+
+// A frozen set is an immutable copy of a set, repacked for lookups only.
+// The fingerprints are placed into 8-slot buckets, one cache line each,
+// at about 97% occupancy (compared to 50-95% for a live set), and each
+// lookup checks exactly two cache lines.  Returns NULL on malloc failure.
+struct fp64set_frozen *fp64set_freeze(const struct fp64set *set);
+void fp64set_frozen_free(struct fp64set_frozen *fz);
+
+// Save the frozen set to a file; returns 0 on success, -1 on error (with
+// errno set).  The file is the exact in-memory image in the native byte
+// order, and can be loaded back with mmap: the buckets are not copied,
+// and the pages are shared between processes.  Returns NULL on error.
+int fp64set_frozen_save(const struct fp64set_frozen *fz, const char *fname);
+struct fp64set_frozen *fp64set_frozen_load(const char *fname);
+
+struct fp64set_frozen {
+    // The lookup routine, depends on the CPU.
+    int (FP64SET_FASTCALL *has)(FP64SET_pFP64, const struct fp64set_frozen *fz);
+    // The buckets, 8 slots each, aligned to a cache line.  Like in a live
+    // set, a free slot holds a value which does not hash into the bucket.
+    const uint64_t *bb;
+    // The number of buckets, not necessarily a power of two.
+    uint64_t nb;
+    // The number of fingerprints.
+    size_t cnt;
+    // The image, i.e. a header followed by the buckets, malloc'd or mmap'd.
+    void *image;
+    size_t imagesize;
+    bool mapped;
+};
+
+// Check if a fingerprint is in the frozen set.
+static inline bool fp64set_frozen_has(const struct fp64set_frozen *fz, uint64_t fp)
+{
+    return fz->has(FP64SET_aFP64(fp), fz);
+}
+
+// Share a set between processes, through a named POSIX shared memory
+// segment (see shm_open(3), link with -lrt on older systems).  The writer
+// builds the set as usual, then copies it into a new segment, which must
+// not exist yet; returns 0 on success, -1 on error (with errno set).  The
+// segment holds no pointers, and can be attached by any process built with
+// the same FP64SET_STASH.  To replace the set, shm_unlink() the name and
+// create it anew; the processes attached to the old segment keep it mapped.
+int fp64set_create_shm(const struct fp64set *set, const char *name);
+
+// Map the segment read-only and set up a set for fp64set_has() and the
+// other read-only calls, using the default kernel; the buckets and the
+// prefilter are not copied.  Returns NULL on error: EAGAIN if the writer
+// has not finished yet, EINVAL if the segment is not a valid set.
+// The set must be released with fp64set_detach_shm(), not fp64set_free().
+const struct fp64set *fp64set_attach_shm(const char *name);
+void fp64set_detach_shm(const struct fp64set *set);
+
+// A windowed set remembers the fingerprints added within the last few
+// generations: a fingerprint added (or added again) in generation g is in
+// the set while the current generation is less than g + window.  Each slot
+// carries the generation, and the lookup checks the fingerprint and its
+// freshness in the same cache line; the expired slots are reused by new
+// fingerprints.  Advancing the window only bumps the current generation
+// (except that every 2^31 generations, the buckets are swept).  The logsize
+// parameter is the expected number of fingerprints alive at a time.
+struct fp64set_window *fp64set_window_new(int logsize, uint32_t window);
+void fp64set_window_free(struct fp64set_window *w);
+
+// Returns 0 if the fingerprint is already in the window, 1 if it was not
+// (either way, it is now stamped with the current generation); 2 if the
+// buckets have been doubled.  Returns -1 on malloc failure, in which case
+// some other fingerprint may have been dropped, as if expired early.
+int fp64set_window_add(struct fp64set_window *w, uint64_t fp);
+
+// Start the next generation.
+void fp64set_window_advance(struct fp64set_window *w);
+
+struct fp64set_window {
+    // The lookup routine, depends on the CPU.
+    int (FP64SET_FASTCALL *has)(FP64SET_pFP64, const struct fp64set_window *w);
+    // The buckets, one cache line each: 5 fingerprints, followed by
+    // the 32-bit generations in which they were last added.
+    void *bb;
+    // The number of buckets - 1.
+    uint32_t mask;
+    // The current generation, and the window size in generations.
+    uint32_t gen;
+    uint32_t window;
+    uint8_t logsize;
+    // For the random walk.
+    uint64_t rnd;
+};
+
+// Check if a fingerprint was added within the window.
+static inline bool fp64set_window_has(const struct fp64set_window *w, uint64_t fp)
+{
+    return w->has(FP64SET_aFP64(fp), w);
+}
+
+// A counting set, or multiset, keeps a count with each fingerprint.  It is
+// built on the buckets of the windowed set, with the counts stored in place
+// of the generations, so that a lookup is still two cache lines, and the
+// SSE4 lookup routine is shared.  The counts saturate at UINT32_MAX.
+struct fp64set_counter *fp64set_counter_new(int logsize);
+void fp64set_counter_free(struct fp64set_counter *c);
+
+// Count the fingerprint, returns the new count.  Returns 0 on malloc
+// failure, in which case either this or some other fingerprint is lost.
+uint32_t fp64set_counter_add(struct fp64set_counter *c, uint64_t fp);
+
+// The count of the fingerprint, 0 if it has not been added.
+uint32_t fp64set_counter_get(const struct fp64set_counter *c, uint64_t fp);
+
+struct fp64set_counter {
+    struct fp64set_window w;
+    // The number of distinct fingerprints.
+    size_t cnt;
+};
+
+static inline bool fp64set_counter_has(const struct fp64set_counter *c, uint64_t fp)
+{
+    return c->w.has(FP64SET_aFP64(fp), &c->w);
+}
+
+static inline size_t fp64set_counter_size(const struct fp64set_counter *c)
+{
+    return c->cnt;
 }
 
+// Copy the fingerprints counted at least threshold times, at most k of
+// them, those with the highest counts, into out, sorted by the count in
+// descending order (and then by the fingerprint).  With k = SIZE_MAX, out
+// must have room for fp64set_counter_size() elements.  Returns the number
+// of elements written.
+struct fp64set_count {
+    uint64_t fp;
+    uint32_t count;
+};
+
+size_t fp64set_counter_export(const struct fp64set_counter *c, uint32_t threshold,
+	struct fp64set_count *out, size_t k);
+
 #ifdef __GNUC__
 #pragma GCC visibility pop
 #endif
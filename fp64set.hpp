@@ -0,0 +1,199 @@
+// Copyright (c) 2017, 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// C++ access to the same struct fp64set, without the indirect calls.
+// fp64set_has() goes through set->has, which cannot be inlined, and after
+// each call the compiler must reload set->bb and set->mask.  Here, the
+// layout of the set (the bucket size and whether the stash is in use)
+// becomes a template parameter, and has() compiles to straight-line code.
+// The layout is dispatched on once per batch with fp64::visit():
+//
+//	size_t hits = fp64::visit(set, [&](auto k) {
+//	    size_t hits = 0;
+//	    for (size_t i = 0; i < n; i++)
+//		hits += k.has(set, fpv[i]);
+//	    return hits;
+//	});
+//
+// Requires C++14, for the generic lambdas.  Compile with -msse4.1 (or
+// -march=native) to get the SSE4 compares, like in fp64set-x86.S.
+
+#pragma once
+#include "fp64set.h"
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+namespace fp64 {
+
+// The routines specialized for the layout.  The specialization is valid
+// until the layout changes, which only add() can do (when it takes the
+// slow path, it can resize the set or stash a fingerprint); check valid()
+// after add() if you keep on using the same kernel.
+template<int BS, bool ST>
+struct kernel {
+    static bool valid(const struct fp64set *set)
+    {
+	return set->bsize == BS && (set->nstash != 0) == ST;
+    }
+
+#ifdef __SSE4_1__
+    static __m128i load(const uint64_t *p)
+    {
+	return _mm_loadu_si128((const __m128i *) p);
+    }
+
+    static bool has(uint64_t fp, const uint64_t *b1, const uint64_t *b2,
+	    const uint64_t *stash)
+    {
+	__m128i x = _mm_set1_epi64x(fp);
+	__m128i m = _mm_or_si128(_mm_cmpeq_epi64(x, load(b1)),
+				 _mm_cmpeq_epi64(x, load(b2)));
+	if (ST)
+	    for (int j = 0; j < FP64SET_STASH; j += 2)
+		m = _mm_or_si128(m, _mm_cmpeq_epi64(x, load(stash + j)));
+	if (BS == 3)
+	    m = _mm_or_si128(m, _mm_cmpeq_epi64(x, _mm_set_epi64x(b1[2], b2[2])));
+	if (BS == 4) {
+	    m = _mm_or_si128(m, _mm_cmpeq_epi64(x, load(b1 + 2)));
+	    m = _mm_or_si128(m, _mm_cmpeq_epi64(x, load(b2 + 2)));
+	}
+	return !_mm_testz_si128(m, m);
+    }
+#else
+    // Branchless, like has() in fp64set.c.
+    static bool has(uint64_t fp, const uint64_t *b1, const uint64_t *b2,
+	    const uint64_t *stash)
+    {
+	int has1 = fp == b1[0];
+	int has2 = fp == b2[0];
+	if (ST) {
+	    for (int j = 0; j < FP64SET_STASH; j += 2) {
+		has1 |= fp == stash[j+0];
+		has2 |= fp == stash[j+1];
+	    }
+	}
+	for (int j = 1; j < BS; j++) {
+	    has1 |= fp == b1[j];
+	    has2 |= fp == b2[j];
+	}
+	return has1 | has2;
+    }
+#endif
+
+    static bool has(const struct fp64set *set, uint64_t fp)
+    {
+	size_t mask = set->mask;
+	const uint64_t *b1 = set->bb + BS * (fp & mask);
+	const uint64_t *b2 = set->bb + BS * (fp >> 32 & mask);
+	return has(fp, b1, b2, set->stash);
+    }
+
+    // The fast path: the fingerprint goes into a free slot of either
+    // bucket, in the same order as in fp64set.c.  Otherwise, the slots
+    // must be shuffled, and set->add takes over.
+    static int add(struct fp64set *set, uint64_t fp)
+    {
+	size_t mask = set->mask;
+	size_t i1 = fp & mask;
+	size_t i2 = fp >> 32 & mask;
+	uint64_t *b1 = set->bb + BS * i1;
+	uint64_t *b2 = set->bb + BS * i2;
+	if (has(fp, b1, b2, set->stash))
+	    return 0;
+	// Free slots hold a value which does not hash into the bucket.
+	uint64_t blank1 = 0 - (uint64_t) (i1 == 0);
+	uint64_t blank2 = 0 - (uint64_t) (i2 == 0);
+	for (int j = 0; j < BS; j++) {
+	    if (b1[j] == blank1)
+		return b1[j] = fp, set->cnt++, 1;
+	    if (b2[j] == blank2)
+		return b2[j] = fp, set->cnt++, 1;
+	}
+	return set->add(FP64SET_aFP64(fp), set);
+    }
+};
+
+// The calls go through fp64set_has() and fp64set_add(), for the sets
+// whose calls are intercepted by the prefilter or the trace, and to keep
+// the statistics (if enabled).
+struct generic {
+    static bool valid(const struct fp64set *) { return true; }
+    static bool has(const struct fp64set *set, uint64_t fp) { return fp64set_has(set, fp); }
+    static int add(struct fp64set *set, uint64_t fp) { return fp64set_add(set, fp); }
+};
+
+// Call f with the kernel for the current layout of the set.
+template<class F>
+inline auto visit(const struct fp64set *set, F &&f) -> decltype(f(generic()))
+{
+#if !FP64SET_STATS
+    if (!set->filter && !set->trace) {
+	switch (set->bsize << 1 | (set->nstash != 0)) {
+	case 4: return f(kernel<2, false>());
+	case 5: return f(kernel<2, true>());
+	case 6: return f(kernel<3, false>());
+	case 7: return f(kernel<3, true>());
+	case 8: return f(kernel<4, false>());
+	case 9: return f(kernel<4, true>());
+	}
+    }
+#endif
+    return f(generic());
+}
+
+// Check a batch of fingerprints, out[i] = fp64set_has(set, fpv[i]).
+// Returns the number of fingerprints found.
+inline size_t has_batch(const struct fp64set *set, const uint64_t *fpv, size_t n, bool *out)
+{
+    return visit(set, [&](auto k) {
+	size_t hits = 0;
+	for (size_t i = 0; i < n; i++)
+	    hits += out[i] = k.has(set, fpv[i]);
+	return hits;
+    });
+}
+
+// Add a batch of fingerprints, rc[i] = fp64set_add(set, fpv[i]).  Stops
+// at the first failure.  Returns the number of fingerprints processed.
+inline size_t add_batch(struct fp64set *set, const uint64_t *fpv, size_t n, int *rc)
+{
+    size_t i = 0;
+    bool failed = false;
+    while (i < n && !failed) {
+	failed = visit(set, [&](auto k) {
+	    while (i < n) {
+		int r = rc[i] = k.add(set, fpv[i]);
+		i++;
+		if (r < 0)
+		    return true;
+		// Dispatch again, with the new layout.
+		if (!k.valid(set))
+		    return false;
+	    }
+	    return false;
+	});
+    }
+    return i;
+}
+
+} // namespace fp64
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -18,25 +18,61 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#define FPSET_PROBA
-#include "fpset.c"
+// The simulations only need the inline primitives from fp64set.c,
+// with the bucket size fixed (no resizing), hence no assembly.
+#ifndef FP64SET_NOASM
+#define FP64SET_NOASM
+#endif
+#include "fp64set.c"
 
 // CPU intrinsics recognized by gcc.
 static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
 static inline uint64_t rotr64(uint64_t x, int r) { return (x >> r) | (x << (64 - r)); }
 
-// The PRNG state is initialized with the first outputs of splitmix64
+// The PRNG seed is initialized with the first outputs of splitmix64
 // seeded with zero (much like suggested in xoroshiro128plus.c).
-static uint64_t prngState = 0xe220a8397b1dcdaf;
+static uint64_t prngSeed = 0xe220a8397b1dcdaf;
 
-#include <string.h>
 #include <sys/auxv.h>
 
 static void randomizePrng(void)
 {
     void *auxrnd = (void *) getauxval(AT_RANDOM);
     assert(auxrnd);
-    memcpy(&prngState, auxrnd, sizeof prngState);
+    memcpy(&prngSeed, auxrnd, sizeof prngSeed);
+}
+
+// Each thread has its own PRNG state.
+static __thread uint64_t prngState;
+
+#define LCG_MUL 0x5851f42d4c957f2d
+#define LCG_ADD 0x14057b7ef767814f
+
+// Advance the LCG by n steps in O(log n) time, see F. Brown,
+// "Random Number Generation with Arbitrary Strides" (1994).
+static uint64_t lcgJump(uint64_t state, uint64_t n)
+{
+    uint64_t mul = LCG_MUL, add = LCG_ADD;
+    uint64_t accmul = 1, accadd = 0;
+    while (n) {
+	if (n & 1)
+	    accmul *= mul, accadd = accadd * mul + add;
+	add *= mul + 1;
+	mul *= mul;
+	n >>= 1;
+    }
+    return accmul * state + accadd;
+}
+
+// The threads take disjoint slices of the full period, 2^48 numbers each,
+// which is enough for 2^30 tries with 2^18 slots.  Within each slice, the
+// numbers are unique, as before.
+static uint64_t nextStream;
+
+static void seedPrng(void)
+{
+    uint64_t k = __atomic_fetch_add(&nextStream, 1, __ATOMIC_RELAXED);
+    prngState = lcgJump(prngSeed, k << 48);
 }
 
 // A fast LCG-based PRNG, medium quality.  Just happens to be good enough
@@ -53,102 +89,184 @@ static inline uint64_t rnd(void)
     uint64_t ret = rotr64(prngState, 12);
     // The state is updated in parallel even as the caller makes use of "ret"
     // to index into the buckets.  Constants are Knuth's.
-    prngState = prngState * 0x5851f42d4c957f2d + 0x14057b7ef767814f;
+    prngState = prngState * LCG_MUL + LCG_ADD;
     return ret;
 }
 
-// A simplified fpset_add() clone, returns the number of kicks.
-static inline int proba_add(struct fpset *set, uint64_t fp)
+// Create a set with a fixed bucket size, bypassing the 2 -> 3 -> 4 growth.
+static struct fp64set *proba_new(int logsize, int bsize)
 {
-    dFP2IB;
-    // No dups during simulations, because of full-period LCG.
-    if (justAdd(fp, b1, i1, b2, i2))
-	return set->cnt++, 0;
-    return kickAdd(set, fp, b1, i1, &fp);
+    struct fp64set *set = fp64set_new(logsize);
+    assert(set);
+    size_t nb = set->mask + 1;
+    set->bb = realloc(set->bb, bsize * nb * sizeof(uint64_t));
+    assert(set->bb);
+    set->bsize = bsize;
+    return set;
 }
 
-// Reset fpset structure to the initial state.
-static inline void proba_clear(struct fpset *set)
+// Reset the set to the initial state.
+static inline void proba_clear(struct fp64set *set)
 {
+    size_t nb = set->mask + 1;
+    memset(set->bb, 0, set->bsize * nb * sizeof(uint64_t));
+    memset(set->bb, 0xff, set->bsize * sizeof(uint64_t));
     set->cnt = 0;
-    memset(set->bb, 0, (set->mask + 1) * sizeof *set->bb);
-    for (int n = 0; n < FPSET_BUCKETSIZE; n++)
-	set->bb[0][n] = -1;
+    set->nstash = 0;
+}
+
+// A simplified fp64set_add() clone.  No dups during simulations, because of
+// full-period LCG, and no resizing.  Returns false when the stash overflows,
+// which is where fp64set_add() would either resize or fail with EAGAIN.
+static inline bool proba_add(struct fp64set *set, uint64_t fp, int bsize)
+{
+    dFP2IB(fp, set->bb, set->mask);
+    set->cnt++;
+    if (justAdd2(fp, b1, i1, b2, i2, bsize))
+	return true;
+    int nkick;
+    if (evictAdd(fp, set->bb, b1, i1, i2, &fp, set->logsize, set->mask, bsize, &nkick))
+	return true;
+    return t_stash(set, fp, bsize);
+}
+
+// Add up to n random fingerprints, returns the number added successfully.
+static inline size_t t_fill(struct fp64set *set, size_t n, int bsize)
+{
+    for (size_t k = 0; k < n; k++)
+	if (!proba_add(set, rnd(), bsize))
+	    return k;
+    return n;
+}
+
+static size_t proba_fill(struct fp64set *set, size_t n)
+{
+    switch (set->bsize) {
+    case 2: return t_fill(set, n, 2);
+    case 3: return t_fill(set, n, 3);
+    default: return t_fill(set, n, 4);
+    }
 }
 
 #include <stdio.h>
-#include "qsort.h"
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// The simulations are run in parallel, each thread with its own set.
+// The results are aggregated with atomic adds, no locks.
+static int nthreads = 1;
+
+struct job {
+    int bucketlog, bsize;
+    // For failurerate(): the number of fingerprints to add in each try,
+    // and the limit on the number of tries; the running totals.
+    size_t n;
+    uint64_t maxtries;
+    uint64_t failures, tries;
+    // For fillfactor(): the next try, and the results of all tries.
+    size_t next, ntries;
+    size_t *fill;
+};
+
+static void runJob(struct job *job, void *(*worker)(void *))
+{
+    pthread_t tid[nthreads];
+    for (int k = 0; k < nthreads; k++) {
+	int rc = pthread_create(&tid[k], NULL, worker, job);
+	assert(rc == 0);
+    }
+    for (int k = 0; k < nthreads; k++)
+	pthread_join(tid[k], NULL);
+}
+
+static int cmpSize(const void *p1, const void *p2)
+{
+    size_t x1 = *(const size_t *) p1;
+    size_t x2 = *(const size_t *) p2;
+    return (x1 > x2) - (x1 < x2);
+}
+
+static void *fillfactorWorker(void *arg)
+{
+    struct job *job = arg;
+    seedPrng();
+    struct fp64set *set = proba_new(job->bucketlog, job->bsize);
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->ntries) {
+	proba_clear(set);
+	job->fill[i] = proba_fill(set, SIZE_MAX);
+    }
+    fp64set_free(set);
+    return NULL;
+}
 
 // Estimate the fill factor achievable 99% of the time.
-static void fillfactor(void)
-{
-    int logfix = FPSET_BUCKETSIZE > 2;
-    for (int logsize = 4 + logfix; logsize <= 16 + logfix; logsize++) {
-	int tries[4000];
-	for (int i = 0; i < 4000; i++) {
-	    struct fpset *set = fpset_new(logsize);
-	    int added = 0;
-	    while (proba_add(set, rnd()) >= 0)
-		added++;
-	    tries[i] = added;
-	    fpset_free(set);
-	}
-	int try1;
-#define tryLess(i, j) tries[i] < tries[j]
-#define trySwap(i, j) try1 = tries[i], tries[i] = tries[j], tries[j] = try1
-	QSORT(4000, tryLess, trySwap);
-	size_t i = sizeof(tries)/sizeof(int)/100; // 100 for q=1%, 4 for q=25%
+static void fillfactor(int bsize)
+{
+    for (int bucketlog = 4; bucketlog <= 16; bucketlog++) {
+	size_t tries[4000];
+	struct job job = { bucketlog, bsize, .ntries = 4000, .fill = tries };
+	runJob(&job, fillfactorWorker);
+	qsort(tries, 4000, sizeof *tries, cmpSize);
+	size_t i = sizeof(tries)/sizeof(*tries)/100; // 100 for q=1%, 4 for q=25%
 	double q = (tries[i-1] + tries[i-2] + tries[i-3] + tries[i-4] +
 		    tries[i+0] + tries[i+1] + tries[i+2] + tries[i+3]) / 8.0;
-	int bucketlog = logsize - logfix;
-	int slots = (1 << bucketlog) * FPSET_BUCKETSIZE;
-	printf("bucketlog=%d\tslots=%d\tq=%.1f\tfillfactor=%.3f\n",
+	size_t slots = (size_t) bsize << bucketlog;
+	printf("bucketlog=%d\tslots=%zu\tq=%.1f\tfillfactor=%.3f\n",
 		bucketlog, slots, q, q / slots);
-
     }
 }
 
-static void failurerate(void)
-{
-    int logfix = FPSET_BUCKETSIZE > 2;
-    int maxbucket = FPSET_BUCKETSIZE == 4 ? 7 :
-		    FPSET_BUCKETSIZE == 3 ? 9 : 12;
-    for (int logsize = 4 + logfix, bucketlog = logsize - logfix;
-	     bucketlog <= maxbucket; logsize++, bucketlog++) {
-	int slots = (1 << bucketlog) * FPSET_BUCKETSIZE;
-	int failures = 0;
-	uint64_t tries = 0;
-	struct fpset *set = fpset_new(logsize);
-	do {
-	    for (int i = 0; i < (1<<20); i++) {
-		proba_clear(set);
-		int j = 0;
-		while (j < slots/2) {
-		    if (proba_add(set, rnd()) < 0) break;
-		    if (proba_add(set, rnd()) < 0) break;
-		    j += 2;
-		}
-		if (j < slots/2) {
-		    failures++;
-		    putc('.', stderr);
-		}
-		tries++;
+// Each thread runs the tries in batches, and checks the totals in between.
+static void *failurerateWorker(void *arg)
+{
+    struct job *job = arg;
+    seedPrng();
+    struct fp64set *set = proba_new(job->bucketlog, job->bsize);
+    /*
+     * See "Estimating Bernoulli trial probability from a small sample".
+     * The expected probability is E=(m+1)/(n+2), and 17 failures
+     * are required for the upper bound (3) not to exceed the real
+     * probability by a factor of more than 1.5 with 90% confidence.
+     *
+    > library(zipfR)
+    > C=.90; m=17; n=17e6
+    > Rbeta.inv((1+C)/2, m+1, n-m+1)
+      [1] 1.499954e-06
+     */
+    while (__atomic_load_n(&job->failures, __ATOMIC_RELAXED) < 17 &&
+	   __atomic_load_n(&job->tries, __ATOMIC_RELAXED) < job->maxtries) {
+	uint64_t failures = 0;
+	for (int i = 0; i < (1<<16); i++) {
+	    proba_clear(set);
+	    if (proba_fill(set, job->n) < job->n) {
+		failures++;
+		putc('.', stderr);
 	    }
-	    /*
-	     * See "Estimating Bernoulli trial probability from a small sample".
-	     * The expected probability is E=(m+1)/(n+2), and 17 failures
-	     * are required for the upper bound (3) not to exceed the real
-	     * probability by a factor of more than 1.5 with 90% confidence.
-	     *
-	    > library(zipfR)
-	    > C=.90; m=17; n=17e6
-	    > Rbeta.inv((1+C)/2, m+1, n-m+1)
-	      [1] 1.499954e-06
-	     */
-	} while (failures < 17);
-	fpset_free(set);
+	}
+	__atomic_fetch_add(&job->failures, failures, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&job->tries, 1<<16, __ATOMIC_RELAXED);
+    }
+    fp64set_free(set);
+    return NULL;
+}
+
+// Estimate the probability that the stash overflows before the set is
+// filled up to the given percentage of slots.  With bsize=4 and fill=50,
+// this is the probability that fp64set_add() fails with EAGAIN.
+static void failurerate(int bsize, int fill, int maxlog)
+{
+    int maxbucket = bsize == 4 ? 7 : bsize == 3 ? 9 : 12;
+    for (int bucketlog = 4; bucketlog <= maxbucket; bucketlog++) {
+	size_t slots = (size_t) bsize << bucketlog;
+	struct job job = { bucketlog, bsize, slots * fill / 100, UINT64_C(1) << maxlog };
+	runJob(&job, failurerateWorker);
+	uint64_t failures = job.failures, tries = job.tries;
 	putc('\n', stderr);
-	printf("%d\t%.1e\n", bucketlog, (failures + 1.0) / (tries + 2));
+	// Fewer than 17 failures means the estimate is rather an upper bound.
+	printf("%d\t%.1e\t%" PRIu64 "/%" PRIu64 "\n", bucketlog,
+		(failures + 1.0) / (tries + 2), failures, tries);
     }
 }
 
@@ -160,22 +278,52 @@ enum {
 
 static const struct option longopts[] = {
     { "randomize", no_argument, NULL, OPT_RANDOMIZE },
+    { "fillfactor", no_argument, NULL, 'F' },
+    { NULL },
 };
 
 int main(int argc, char **argv)
 {
+    int bsize = 4, fill = 50, maxlog = 30;
+    bool F = false;
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
     int c;
-    while ((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1)
+    while ((c = getopt_long(argc, argv, "b:f:n:j:Fh", longopts, NULL)) != -1)
 	switch (c) {
 	case 0:
 	    break;
+	case 'b':
+	    bsize = atoi(optarg);
+	    break;
+	case 'f':
+	    fill = atoi(optarg);
+	    break;
+	case 'n':
+	    maxlog = atoi(optarg);
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'F':
+	    F = true;
+	    break;
 	case OPT_RANDOMIZE:
 	    randomizePrng();
 	    break;
 	default:
-	    fprintf(stderr, "Usage: %s [OPTIONS...] [ARGS...]\n", argv[0]);
+	usage:
+	    fprintf(stderr, "Usage: %s [-b BSIZE] [-f FILL%%] [-n LOGTRIES] [-j THREADS] "
+			    "[--fillfactor] [--randomize]\n", argv[0]);
 	    return 1;
 	}
-    failurerate();
+    if (bsize < 2 || bsize > 4 || fill < 1 || fill > 100 || maxlog < 20 || nthreads < 1)
+	goto usage;
+    // The stash size and the eviction method are compile-time parameters,
+    // e.g. -DFP64SET_STASH=2 -DFP64SET_BFS=1.
+    fprintf(stderr, "bsize=%d stash=%d bfs=%d threads=%d\n", bsize, FP64SET_STASH, FP64SET_BFS, nthreads);
+    if (F)
+	fillfactor(bsize);
+    else
+	failurerate(bsize, fill, maxlog);
     return 0;
 }
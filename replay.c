@@ -0,0 +1,155 @@
+// Replay a trace recorded with fp64set_trace(), with each kernel (or only
+// the one given with -k), verifying the return values and reporting the
+// throughput.  The replay is timed from the first add/has record; the
+// contents of the set loaded at the start is not included.  A set rebuilt
+// from the loaded contents need not resize at exactly the same points as
+// the original one, so 1 vs 2 returned by fp64set_add() is only counted.
+//
+//	replay [-k c|branchy|sse4] [-f BITS] [-n REPEAT] TRACE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fp64set.h"
+
+static const char *kernelNames[] = { "c", "branchy", "sse4" };
+
+static inline uint64_t nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Replay the records against a new set; returns the number of mismatches.
+static size_t replay(const struct fp64set_trace_header *h,
+	const unsigned char *rec, size_t nrec, int kernel, int fbits,
+	bool verbose, uint64_t *tp, size_t *np, size_t *nresize)
+{
+    struct fp64set *set = fp64set_new(h->logsize);
+    assert(set);
+    if (fp64set_set_kernel(set, kernel) < 0)
+	return fp64set_free(set), SIZE_MAX;
+    if (fbits && fp64set_prefilter(set, fbits) < 0)
+	return fp64set_free(set), SIZE_MAX;
+    size_t i = 0;
+    for (; i < nrec; i++) {
+	const unsigned char *p = rec + FP64SET_TRACE_RECSIZE * i;
+	if ((p[0] & 15) != FP64SET_TRACE_LOAD)
+	    break;
+	uint64_t fp;
+	memcpy(&fp, p + 1, sizeof fp);
+	fp64set_add(set, fp);
+    }
+    size_t bad = 0, resize = 0;
+    uint64_t t = nsec();
+    for (size_t j = i; j < nrec; j++) {
+	const unsigned char *p = rec + FP64SET_TRACE_RECSIZE * j;
+	uint64_t fp;
+	memcpy(&fp, p + 1, sizeof fp);
+	int op = p[0] & 15;
+	int rc0 = (p[0] >> 4) - 1;
+	int rc = op == FP64SET_TRACE_ADD ?
+		fp64set_add(set, fp) : fp64set_has(set, fp);
+	if (rc == rc0)
+	    continue;
+	if (rc > 0 && rc0 > 0) {
+	    resize++;
+	    continue;
+	}
+	if (bad++ < 8 && verbose)
+	    fprintf(stderr, "record %zu: %s %016" PRIx64 " returned %d, expected %d\n",
+		    j, op == FP64SET_TRACE_ADD ? "add" : "has", fp, rc, rc0);
+    }
+    *tp = nsec() - t;
+    *np = nrec - i;
+    *nresize = resize;
+    fp64set_free(set);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    int kernel = -1, fbits = 0, repeat = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:f:n:")) != -1) {
+	switch (opt) {
+	case 'k':
+	    for (int k = 0; k < 3; k++)
+		if (strcmp(optarg, kernelNames[k]) == 0)
+		    kernel = k;
+	    if (kernel < 0) {
+		fprintf(stderr, "replay: unknown kernel %s\n", optarg);
+		return 1;
+	    }
+	    break;
+	case 'f':
+	    fbits = atoi(optarg);
+	    break;
+	case 'n':
+	    repeat = atoi(optarg);
+	    break;
+	default:
+	    goto usage;
+	}
+    }
+    if (optind + 1 != argc) {
+usage:	fprintf(stderr, "Usage: replay [-k c|branchy|sse4] [-f BITS] [-n REPEAT] TRACE\n");
+	return 1;
+    }
+    const char *fname = argv[optind];
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	perror(fname);
+	return 1;
+    }
+    const struct fp64set_trace_header *h = NULL;
+    if ((size_t) st.st_size >= sizeof *h)
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (h == MAP_FAILED || !h || memcmp(h->magic, "fp64trc1", 8)) {
+	fprintf(stderr, "%s: not a trace\n", fname);
+	return 1;
+    }
+    close(fd);
+    if (h->stash != FP64SET_STASH)
+	fprintf(stderr, "%s: recorded with FP64SET_STASH=%d, return values may differ\n",
+		fname, h->stash);
+    size_t nrec = (st.st_size - sizeof *h) / FP64SET_TRACE_RECSIZE;
+    const unsigned char *rec = (const unsigned char *) (h + 1);
+    int status = 0;
+    for (int k = 0; k < 3; k++) {
+	if (kernel >= 0 && k != kernel)
+	    continue;
+	// Report the best of the repeats.
+	uint64_t t = UINT64_MAX;
+	size_t n = 0, bad = 0, resize = 0;
+	for (int r = 0; r < repeat; r++) {
+	    uint64_t t1;
+	    bad = replay(h, rec, nrec, k, fbits, r == 0, &t1, &n, &resize);
+	    if (bad == SIZE_MAX)
+		break;
+	    if (t1 < t)
+		t = t1;
+	}
+	if (bad == SIZE_MAX) {
+	    if (kernel >= 0)
+		fprintf(stderr, "replay: kernel %s not available\n", kernelNames[k]);
+	    continue;
+	}
+	printf("%-8s %zu ops %.2f ns/op %.1f Mops/s %zu mismatches %zu resize diffs\n",
+		kernelNames[k], n, (double) t / n, n * 1e3 / t, bad, resize);
+	if (bad)
+	    status = 1;
+    }
+    return status;
+}
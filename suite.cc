@@ -0,0 +1,366 @@
+// The benchmark suite: fp64set (with each kernel) against std::unordered_set
+// and a plain open-addressing table, at table sizes from L1 to 8x LLC, with
+// hit ratios from 0 to 100% and a few add/has mixes.  Results go to stdout
+// as JSON, one object per run, to be diffed across releases; the progress
+// goes to stderr.  Hardware counters are collected with perf_event_open(2)
+// where permitted, otherwise they come out as null.
+//
+//	gcc -O2 -c fp64set.c fp64set-x86.S
+//	g++ -O2 -o suite suite.cc fp64set.o fp64set-x86.o -Wl,-z,noexecstack
+//	./suite [-q] [-n LOGOPS] [-M MAXBYTES] >results.json
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cinttypes>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include "fp64set.h"
+
+static inline uint64_t rotr64(uint64_t x, int r)
+{
+    return (x >> r) | (x << (64 - r));
+}
+
+#define RND_SEED 16294208416658607535ULL
+static uint64_t rndState = RND_SEED;
+
+static inline uint64_t rnd(void)
+{
+    uint64_t ret = rotr64(rndState, 16);
+    rndState = rndState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return ret;
+}
+
+// The counters, in a single group, so that they are scheduled together.
+static const struct { uint32_t type; uint64_t config; const char *name; } events[] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+	    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "dtlb_misses" },
+};
+#define NEV (sizeof events / sizeof *events)
+
+static int evfd[NEV];
+
+static void perfOpen(void)
+{
+    int leader = -1;
+    for (size_t i = 0; i < NEV; i++) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = leader < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	evfd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+	if (leader < 0)
+	    leader = evfd[i];
+	// Without the leader, nothing can be counted.
+	if (leader < 0) {
+	    fprintf(stderr, "perf_event_open: %m, no counters\n");
+	    return;
+	}
+	if (evfd[i] < 0)
+	    fprintf(stderr, "perf_event_open %s: %m\n", events[i].name);
+    }
+}
+
+static void perfStart(void)
+{
+    if (evfd[0] < 0)
+	return;
+    ioctl(evfd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(evfd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// Stop counting for a while, without losing the counts.
+static void perfPause(bool pause)
+{
+    if (evfd[0] < 0)
+	return;
+    ioctl(evfd[0], pause ? PERF_EVENT_IOC_DISABLE : PERF_EVENT_IOC_ENABLE,
+	    PERF_IOC_FLAG_GROUP);
+}
+
+// The counters which failed to open are set to -1.
+static void perfStop(int64_t cnt[NEV])
+{
+    for (size_t i = 0; i < NEV; i++)
+	cnt[i] = -1;
+    if (evfd[0] < 0)
+	return;
+    ioctl(evfd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t buf[1 + NEV];
+    if (read(evfd[0], buf, sizeof buf) < 8)
+	return;
+    for (size_t i = 0, j = 1; i < NEV && j <= buf[0]; i++)
+	if (evfd[i] >= 0)
+	    cnt[i] = buf[j++];
+}
+
+static inline uint64_t nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+namespace {
+
+// The baseline: linear probing, with 0 serving as the empty slot,
+// grows at 50% load.  The fingerprints are random, so the low bits
+// serve as the hash.
+struct OpenSet {
+    std::vector<uint64_t> v;
+    size_t mask, cnt;
+    bool zero;
+    OpenSet(size_t n) : v(2 * n), mask(2 * n - 1), cnt(0), zero(false) {}
+    bool has(uint64_t fp) const
+    {
+	if (fp == 0)
+	    return zero;
+	for (size_t i = fp & mask; ; i = (i + 1) & mask) {
+	    if (v[i] == fp)
+		return true;
+	    if (v[i] == 0)
+		return false;
+	}
+    }
+    bool add(uint64_t fp)
+    {
+	if (fp == 0)
+	    return zero ? false : (zero = true);
+	size_t i = fp & mask;
+	for (; v[i]; i = (i + 1) & mask)
+	    if (v[i] == fp)
+		return false;
+	v[i] = fp;
+	if (++cnt > mask / 2)
+	    grow();
+	return true;
+    }
+    void grow()
+    {
+	std::vector<uint64_t> old(2 * v.size());
+	old.swap(v);
+	mask = v.size() - 1;
+	for (uint64_t fp : old)
+	    for (size_t i = fp & mask; fp; i = (i + 1) & mask)
+		if (v[i] == 0) {
+		    v[i] = fp;
+		    break;
+		}
+    }
+};
+
+// The implementations share the interface below; the workload loop
+// is instantiated for each of them.
+struct ImplFP64 {
+    struct fp64set *set;
+    ImplFP64(int logsize, int kernel) : set(fp64set_new(logsize))
+    {
+	assert(set);
+	if (kernel >= 0)
+	    fp64set_set_kernel(set, kernel);
+    }
+    ~ImplFP64() { fp64set_free(set); }
+    bool has(uint64_t fp) const { return fp64set_has(set, fp); }
+    bool add(uint64_t fp)
+    {
+	int rc = fp64set_add(set, fp);
+	if (rc < 0) {
+	    fprintf(stderr, "fp64set_add: %m\n");
+	    exit(1);
+	}
+	return rc > 0;
+    }
+};
+
+struct ImplStd {
+    std::unordered_set<uint64_t> set;
+    ImplStd(int logsize, int) { set.reserve((size_t) 1 << logsize); }
+    bool has(uint64_t fp) const { return set.count(fp); }
+    bool add(uint64_t fp) { return set.insert(fp).second; }
+};
+
+struct ImplOpen {
+    OpenSet set;
+    ImplOpen(int logsize, int) : set((size_t) 1 << logsize) {}
+    bool has(uint64_t fp) const { return set.has(fp); }
+    bool add(uint64_t fp) { return set.add(fp); }
+};
+
+} // namespace
+
+// A run: the set is filled with n keys (not timed), then a sequence of
+// ops is timed, addpct percent of them adding new keys, the rest being
+// lookups with hitpct percent of hits.  The new keys come from a pool of
+// n/4 more keys; once the pool is used up, the set is rebuilt with the
+// n keys (not timed), so that it stays within 25% of its nominal size.
+// Each run starts with the same random state, so that all implementations
+// get the same keys and the same ops.
+struct Run {
+    const char *impl;
+    size_t n;
+    int hitpct, addpct;
+    size_t nops;
+};
+
+template<class Impl>
+static std::unique_ptr<Impl> fill(int logsize, int kernel, const std::vector<uint64_t> &keys, size_t n)
+{
+    std::unique_ptr<Impl> impl(new Impl(logsize, kernel));
+    for (size_t i = 0; i < n; i++)
+	impl->add(keys[i]);
+    return impl;
+}
+
+template<class Impl>
+static void run(const Run &r, int kernel, std::vector<uint64_t> &keys,
+	std::vector<uint64_t> &ops, std::vector<uint8_t> &isadd)
+{
+    int logsize = 4;
+    while (((size_t) 1 << logsize) < r.n)
+	logsize++;
+    rndState = RND_SEED;
+    size_t npool = r.n / 4 + 1;
+    keys.resize(r.n + npool);
+    for (size_t i = 0; i < r.n + npool; i++)
+	keys[i] = rnd();
+    std::unique_ptr<Impl> impl = fill<Impl>(logsize, kernel, keys, r.n);
+    // The ops before which the set is rebuilt.
+    std::vector<size_t> cuts;
+    ops.resize(r.nops);
+    isadd.resize(r.nops);
+    for (size_t i = 0, j = 0; i < r.nops; i++) {
+	isadd[i] = rnd() % 100 < (unsigned) r.addpct;
+	if (isadd[i]) {
+	    if (j == npool)
+		cuts.push_back(i), j = 0;
+	    ops[i] = keys[r.n + j++];
+	}
+	else
+	    ops[i] = rnd() % 100 < (unsigned) r.hitpct ? keys[rnd() % r.n] : rnd();
+    }
+    int64_t cnt[NEV];
+    size_t sum = 0;
+    uint64_t t = 0;
+    perfStart();
+    for (size_t c = 0, i = 0; c <= cuts.size(); c++) {
+	size_t end = c < cuts.size() ? cuts[c] : r.nops;
+	uint64_t t0 = nsec();
+	for (; i < end; i++)
+	    sum += isadd[i] ? impl->add(ops[i]) : impl->has(ops[i]);
+	t += nsec() - t0;
+	if (end < r.nops) {
+	    perfPause(true);
+	    impl.reset();
+	    impl = fill<Impl>(logsize, kernel, keys, r.n);
+	    perfPause(false);
+	}
+    }
+    perfStop(cnt);
+    printf("{\"impl\":\"%s\",\"keys\":%zu,\"hit\":%d,\"add\":%d,\"ops\":%zu,"
+	    "\"nonzero\":%zu,\"ns_per_op\":%.3f", r.impl, r.n, r.hitpct, r.addpct,
+	    r.nops, sum, (double) t / r.nops);
+    for (size_t i = 0; i < NEV; i++)
+	if (cnt[i] < 0)
+	    printf(",\"%s\":null", events[i].name);
+	else
+	    printf(",\"%s\":%.4f", events[i].name, (double) cnt[i] / r.nops);
+    printf("}\n");
+    fflush(stdout);
+    fprintf(stderr, "%-16s keys=%-10zu hit=%3d%% add=%2d%% %7.2f ns/op\n",
+	    r.impl, r.n, r.hitpct, r.addpct, (double) t / r.nops);
+}
+
+static size_t cacheSize(int name, size_t dflt)
+{
+    long sz = sysconf(name);
+    return sz > 0 ? sz : dflt;
+}
+
+int main(int argc, char **argv)
+{
+    bool quick = false;
+    int logops = 22;
+    size_t maxbytes = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "qn:M:")) != -1) {
+	switch (opt) {
+	case 'q':
+	    quick = true;
+	    break;
+	case 'n':
+	    logops = atoi(optarg);
+	    assert(logops > 0 && logops < 40);
+	    break;
+	case 'M':
+	    maxbytes = strtoull(optarg, NULL, 0);
+	    break;
+	default:
+	    fprintf(stderr, "Usage: suite [-q] [-n LOGOPS] [-M MAXBYTES]\n");
+	    return 1;
+	}
+    }
+    size_t l1 = cacheSize(_SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+    size_t llc = cacheSize(_SC_LEVEL3_CACHE_SIZE, 0);
+    if (llc == 0)
+	llc = cacheSize(_SC_LEVEL2_CACHE_SIZE, 8 << 20);
+    if (maxbytes == 0)
+	maxbytes = 8 * llc;
+    perfOpen();
+
+    // A live fp64set takes 10-16 bytes per key, depending on the fill.
+    // The sizes go in steps of 4x from L1 to the max.
+    std::vector<size_t> sizes;
+    for (size_t bytes = l1; bytes <= maxbytes; bytes *= quick ? 16 : 4)
+	sizes.push_back(bytes / 16);
+    std::vector<int> hits = { 0, 25, 50, 75, 100 };
+    std::vector<int> adds = { 0, 10, 50 };
+    if (quick)
+	hits = { 0, 50, 100 }, adds = { 0, 50 };
+
+    struct { const char *name; int kernel; } fp64impl[] = {
+	{ "fp64set", -1 },
+	{ "fp64set/c", FP64SET_KERNEL_C },
+	{ "fp64set/branchy", FP64SET_KERNEL_BRANCHY },
+	{ "fp64set/sse4", FP64SET_KERNEL_SSE4 },
+    };
+    // Probe which kernels are available here.
+    bool avail[4] = { true };
+    for (int k = 1; k < 4; k++) {
+	struct fp64set *set = fp64set_new(4);
+	avail[k] = fp64set_set_kernel(set, fp64impl[k].kernel) == 0;
+	fp64set_free(set);
+    }
+
+    std::vector<uint64_t> keys, ops;
+    std::vector<uint8_t> isadd;
+    size_t nops = (size_t) 1 << logops;
+    for (size_t n : sizes)
+    for (int addpct : adds)
+    for (int hitpct : hits) {
+	for (int k = 0; k < 4; k++)
+	    if (avail[k])
+		run<ImplFP64>(Run{fp64impl[k].name, n, hitpct, addpct, nops},
+			fp64impl[k].kernel, keys, ops, isadd);
+	run<ImplStd>(Run{"unordered_set", n, hitpct, addpct, nops}, 0, keys, ops, isadd);
+	run<ImplOpen>(Run{"open", n, hitpct, addpct, nops}, 0, keys, ops, isadd);
+    }
+    return 0;
+}